@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+    Keccak throughput benchmark for sha3.c. Built by "make bench712" with optimization on and
+    the Keccak-f[1600] core selected by the makefile KECCAK variable.
+
+    Every test is run BENCH_WARMUP times untimed, then BENCH_REPS timed repetitions. The
+    median repetition is reported as ns/hash, cycles/byte and hashes/sec, with the relative
+    standard deviation of the repetitions so noisy results can be spotted.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "trezor/crypto/sha3.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()    __rdtsc()
+#else
+#define CYCLES()    0
+#endif
+
+#if defined(SHA3_BMI2)
+#define KECCAK_CORE "bmi2"
+#elif defined(SHA3_UNROLLED)
+#define KECCAK_CORE "unrolled"
+#else
+#define KECCAK_CORE "ref"
+#endif
+
+#define BENCH_MAXSIZE   (1024*1024)
+#define BENCH_WARMUP    2
+#define BENCH_REPS      11
+#define BENCH_REP_BYTES (4*1024*1024)   // input hashed per repetition, sets the iteration count
+#define BENCH_MIN_ITERS 4
+#define BENCH_MAX_ITERS 200000
+#define BENCH_MULTI_N   64
+
+typedef struct {
+    const unsigned char *msg;
+    size_t size;
+    unsigned char digest[32];
+} benchArg;
+
+typedef void (*benchFn)(benchArg *arg, unsigned iters);
+
+static unsigned char msgBuf[BENCH_MAXSIZE + 64];
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static void oneShot(benchArg *arg, unsigned iters) {
+    unsigned ctr;
+    for (ctr=0; ctr<iters; ctr++) {
+        keccak_256(arg->msg, arg->size, arg->digest);
+    }
+}
+
+static void fixed32(benchArg *arg, unsigned iters) {
+    unsigned ctr;
+    for (ctr=0; ctr<iters; ctr++) {
+        keccak256_32(arg->msg, arg->digest);
+    }
+}
+
+// streaming in the uneven chunk sizes a parser produces, including block-straddling ones
+static void ragged(benchArg *arg, unsigned iters) {
+    static const size_t chunks[] = {1, 7, 31, 32, 64, 135, 136, 137, 200, 1000};
+    SHA3_CTX ctx;
+    unsigned ctr;
+
+    for (ctr=0; ctr<iters; ctr++) {
+        size_t done = 0, chunk = 0;
+        sha3_256_Init(&ctx);
+        while (done < arg->size) {
+            size_t len = chunks[chunk++ % (sizeof(chunks)/sizeof(chunks[0]))];
+            if (len > arg->size - done) {
+                len = arg->size - done;
+            }
+            sha3_Update(&ctx, arg->msg + done, len);
+            done += len;
+        }
+        keccak_Final(&ctx, arg->digest);
+    }
+}
+
+// single sha3_Update call, arg->msg alignment decides between in-place and memcpy blocks
+static void streamed(benchArg *arg, unsigned iters) {
+    SHA3_CTX ctx;
+    unsigned ctr;
+
+    for (ctr=0; ctr<iters; ctr++) {
+        sha3_256_Init(&ctx);
+        sha3_Update(&ctx, arg->msg, arg->size);
+        keccak_Final(&ctx, arg->digest);
+    }
+}
+
+// BENCH_MULTI_N independent messages per call, results are per message
+static void multi(benchArg *arg, unsigned iters) {
+    const unsigned char *data[BENCH_MULTI_N];
+    size_t len[BENCH_MULTI_N];
+    unsigned char digests[BENCH_MULTI_N][32];
+    unsigned char *digest[BENCH_MULTI_N];
+    unsigned ctr;
+
+    for (ctr=0; ctr<BENCH_MULTI_N; ctr++) {
+        data[ctr] = arg->msg + ctr;
+        len[ctr] = arg->size;
+        digest[ctr] = digests[ctr];
+    }
+    for (ctr=0; ctr<iters; ctr+=BENCH_MULTI_N) {
+        keccak_256_multi(data, len, digest, BENCH_MULTI_N);
+    }
+    memcpy(arg->digest, digests[0], 32);
+}
+
+static void runBench(const char *name, benchFn fn, const unsigned char *msg, size_t size, unsigned multiple) {
+    double nsPerHash[BENCH_REPS], cyclesPerHash[BENCH_REPS];
+    double mean = 0, var = 0, medNs, medCycles;
+    benchArg arg;
+    unsigned iters, rep;
+    uint64_t ns, cycles;
+    char cpb[16];
+
+    arg.msg = msg;
+    arg.size = size;
+    iters = BENCH_REP_BYTES / (size ? size : 32);
+    if (iters < BENCH_MIN_ITERS) {
+        iters = BENCH_MIN_ITERS;
+    }
+    if (iters > BENCH_MAX_ITERS) {
+        iters = BENCH_MAX_ITERS;
+    }
+    iters = (iters + multiple - 1) / multiple * multiple;
+
+    for (rep=0; rep<BENCH_WARMUP; rep++) {
+        fn(&arg, iters);
+    }
+    for (rep=0; rep<BENCH_REPS; rep++) {
+        ns = nowNs();
+        cycles = CYCLES();
+        fn(&arg, iters);
+        cycles = CYCLES() - cycles;
+        ns = nowNs() - ns;
+        nsPerHash[rep] = (double)ns / iters;
+        cyclesPerHash[rep] = (double)cycles / iters;
+        mean += nsPerHash[rep];
+    }
+    mean /= BENCH_REPS;
+    for (rep=0; rep<BENCH_REPS; rep++) {
+        var += (nsPerHash[rep] - mean) * (nsPerHash[rep] - mean);
+    }
+    var /= BENCH_REPS;
+
+    qsort(nsPerHash, BENCH_REPS, sizeof(double), cmpDouble);
+    qsort(cyclesPerHash, BENCH_REPS, sizeof(double), cmpDouble);
+    medNs = nsPerHash[BENCH_REPS/2];
+    medCycles = cyclesPerHash[BENCH_REPS/2];
+
+    if (size) {
+        snprintf(cpb, sizeof(cpb), "%.2f", medCycles / size);
+    } else {
+        snprintf(cpb, sizeof(cpb), "-");
+    }
+    printf("%-22s %8u %12.1f %12s %14.0f %7.1f%%\n", name, (unsigned)size, medNs, cpb,
+           1e9 / medNs, mean > 0 ? 100.0 * sqrt(var) / mean : 0.0);
+}
+
+int main(void) {
+    static const size_t sizes[] = {0, 32, 64, 135, 136, 1024, BENCH_MAXSIZE};
+    unsigned char *aligned = msgBuf;
+    unsigned ctr;
+
+    for (ctr=0; ctr<sizeof(msgBuf); ctr++) {
+        msgBuf[ctr] = (unsigned char)(ctr * 131 + 7);
+    }
+    // sha3_Update hashes 8-byte aligned blocks in place
+    while (((uintptr_t)aligned & 7) != 0) {
+        aligned++;
+    }
+
+    printf("keccak core %s, median of %d repetitions after %d warmup runs\n\n",
+           KECCAK_CORE, BENCH_REPS, BENCH_WARMUP);
+    printf("%-22s %8s %12s %12s %14s %8s\n", "test", "bytes", "ns/hash", "cycles/byte", "hashes/sec", "stddev");
+
+    for (ctr=0; ctr<sizeof(sizes)/sizeof(sizes[0]); ctr++) {
+        runBench("keccak_256", oneShot, aligned, sizes[ctr], 1);
+    }
+    runBench("keccak256_32", fixed32, aligned, 32, 1);
+    runBench("keccak_256_multi", multi, aligned, 32, BENCH_MULTI_N);
+    runBench("keccak_256_multi", multi, aligned, 1024, BENCH_MULTI_N);
+    runBench("ragged sha3_Update", ragged, aligned, 1024, 1);
+    runBench("ragged sha3_Update", ragged, aligned, BENCH_MAXSIZE, 1);
+    runBench("aligned sha3_Update", streamed, aligned, 1024, 1);
+    runBench("unaligned sha3_Update", streamed, aligned + 1, 1024, 1);
+    runBench("aligned sha3_Update", streamed, aligned, BENCH_MAXSIZE, 1);
+    runBench("unaligned sha3_Update", streamed, aligned + 1, BENCH_MAXSIZE, 1);
+
+    return EXIT_SUCCESS;
+}
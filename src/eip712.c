@@ -27,12 +27,14 @@
         requires all complete json message strings to be enclosed by braces, i.e., { ... }
         Cannot have entire json string quoted, i.e., "{ ... }" will not work.
         Remove all quote escape chars, e.g., {"types":  not  {\"types\":
-    ints: Strings representing ints must fit into a long size (64-bits). 
-        Note: Do not prefix ints or uints with 0x
+    ints: json numbers or strings, decimal or 0x prefixed hex, with an optional '-' sign.
+        Values are 256-bit and must fit the intN/uintN width. Decimals may have a fraction
+        and exponent if the value is whole, e.g., 1e+21.
     All hex and byte strings must be big-endian
     Byte strings and address should be prefixed by 0x
 */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,214 +44,271 @@
 #include "keepkey/firmware/tiny-json.h"
 #include "trezor/crypto/sha3.h"
 #include "trezor/crypto/memzero.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-extern unsigned end;    // This is at the end of the data + bss, used for recursion guard
-static const char *udefList[MAX_USERDEF_TYPES] = {0};
-static dm confirmProp;
+static eip712_ctx defaultCtx;               // context of encode() and the other context-free calls, see eip712.h for its size
 
-static const char *nameForValue;
-
-int memcheck() {
-    // char buf[33] = {0};
-    void *stackBottom;    // this is the bottom of the stack, it is shrinking toward static mem at variable "end".
-    // snprintf(buf, 64, "RAM available %u", (unsigned)&stackBottom - (unsigned)&end);
-    // DEBUG_DISPLAY(buf);
-    if (STACK_SIZE_GUARD > ((unsigned)&stackBottom - (unsigned)&end)) {
-        return RECURSION_ERROR;
-    } else {
-        return SUCCESS;
-    }
+// Absorbs the characters of string, without its nul
+void absorbString(struct SHA3_CTX *hashCtx, const char *string) {
+    sha3_Update(hashCtx, (const unsigned char *)string, strlen(string));
 }
 
-int encodableType(const char *typeStr) {
-    int ctr;
+/*
+    Entry: 
+            ctx points to the encoder context
+            plan points to the plan being compiled, fields resolved
+            eip712Types points to eip712 json type structure the plan was compiled from
+            type points to the plan type to parse
+            hashCtx points to initialized hash context
+    Exit:  
+            hashCtx has absorbed the hashable type string
+            returns error list status
 
-    if (0 == strncmp(typeStr, "address", sizeof("address")-1)) {
-        return ADDRESS;
-    }
-    if (0 == strncmp(typeStr, "string", sizeof("string")-1)) {
-        return STRING;
-    }
-    if (0 == strncmp(typeStr, "int", sizeof("int")-1)) {
-        // This could be 'int8', 'int16', ..., 'int256'
-        return INT;
+    The hashable type string is each parsed type, "name(type field,...)": type first, then
+    the types it depends on sorted by name, as EIP-712 and metamask do. A depth first walk of
+    the resolved plan fields finds the dependencies, keeping an explicit stack in ctx. The
+    strings are hashed in a second pass over the sorted types, piece by piece, so there is
+    no limit on their length.
+*/
+int parseType(eip712_ctx *ctx, const eip712Plan *plan, const json_t *eip712Types, const planType *type,
+              struct SHA3_CTX *hashCtx) {
+    json_t const *jType, *tarray, *pairs;
+    const planField *field;
+    const planType *sorted;
+    typeFrame *frame;
+    uint8_t reached[MAX_PLAN_TYPES] = {0};
+    unsigned depth = 0, numTypes = 0, ctr, pos;
+
+    ctx->typeFrames[depth].type = type;
+    ctx->typeFrames[depth++].field = 0;
+    ctx->typeOrder[numTypes++] = type;
+    reached[type - plan->types] = 1;
+
+    while (depth > 0) {
+        frame = &ctx->typeFrames[depth-1];
+        if (frame->field == frame->type->numFields) {
+            // all fields of this type parsed, continue with its parent
+            depth--;
+            continue;
+        }
+        field = &plan->fields[frame->type->firstField + frame->field++];
+        if (SUCCESS != field->status) {
+            return field->status;
+        }
+        if (field->kind != UDEF_TYPE || reached[field->child]) {
+            continue;
+        }
+        // user defined type reached the first time, parse it before the next field
+        if (numTypes == MAX_USERDEF_TYPES+1) {
+            return UDEFS_OVERFLOW;
+        }
+        reached[field->child] = 1;
+        ctx->typeOrder[numTypes++] = &plan->types[field->child];
+        ctx->typeFrames[depth].type = &plan->types[field->child];
+        ctx->typeFrames[depth++].field = 0;
     }
-    if (0 == strncmp(typeStr, "uint", sizeof("uint")-1)) {
-        // This could be 'uint8', 'uint16', ..., 'uint256'
-        return UINT;
+
+    // dependencies by name, few enough for an insertion sort
+    for (ctr=2; ctr<numTypes; ctr++) {
+        sorted = ctx->typeOrder[ctr];
+        for (pos=ctr; pos>1 && 0 < strcmp(&plan->strings[ctx->typeOrder[pos-1]->name],
+                                            &plan->strings[sorted->name]); pos--) {
+            ctx->typeOrder[pos] = ctx->typeOrder[pos-1];
+        }
+        ctx->typeOrder[pos] = sorted;
     }
-    if (0 == strncmp(typeStr, "bytes", sizeof("bytes")-1)) {
-        // This could be 'bytes', 'bytes1', ..., 'bytes32'
-        if (0 == strcmp(typeStr, "bytes")) {
-            return BYTES;
-        } else {
-            // parse out the length val
-            uint8_t byteTypeSize = (uint8_t)(strtol((typeStr+5), NULL, 10));
-            if (byteTypeSize > 32) {
-                return NOT_ENCODABLE;
-            } else {
-                return BYTES_N;
+
+    // hash the types, fields were checked by the walk
+    for (ctr=0; ctr<numTypes; ctr++) {
+        jType = json_getProperty(eip712Types, &plan->strings[ctx->typeOrder[ctr]->name]);
+        absorbString(hashCtx, json_getName(jType));
+        absorbString(hashCtx, "(");
+        for (tarray = json_getChild(jType); tarray != 0; tarray = json_getSibling(tarray)) {
+            pairs = json_getChild(tarray);
+            if (tarray != json_getChild(jType)) {
+                absorbString(hashCtx, ",");
             }
+            absorbString(hashCtx, json_getValue(json_getSibling(pairs)));
+            absorbString(hashCtx, " ");
+            absorbString(hashCtx, json_getValue(pairs));
         }
-    }
-    if (0 == strcmp(typeStr, "bool")) {
-        return BOOL;
+        absorbString(hashCtx, ")");
     }
 
-    // See if type already defined. If so, skip, otherwise add it to list
-    for(ctr=0; ctr<MAX_USERDEF_TYPES; ctr++) {
-        char typeNoArrTok[MAX_TYPESTRING] = {0};
-
-        strncpy(typeNoArrTok, typeStr, sizeof(typeNoArrTok)-1);
-        strtok(typeNoArrTok, "[");  // eliminate the array tokens if there
+    return SUCCESS;
+}
 
-        if (udefList[ctr] != 0) {
-            if (0 == strncmp(udefList[ctr], typeNoArrTok, strlen(udefList[ctr])-strlen(typeNoArrTok))) {
-                return PREV_USERDEF;
-            }
-            else {}
+void arrayHashInit(arrayHash *arrHash) {
+    arrHash->count = 0;
+}
 
-        } else {
-            udefList[ctr] = typeStr;
-            return UDEF_TYPE;
+void arrayHashAdd(arrayHash *arrHash, const uint8_t *word) {
+    if (arrHash->count < ARRAY_HASH_WORDS) {
+        memcpy(&arrHash->words[32*arrHash->count], word, 32);
+    } else {
+        if (arrHash->count == ARRAY_HASH_WORDS) {
+            // buffer is full, continue in a hash context
+            sha3_256_Init(&arrHash->ctx);
+            sha3_Update(&arrHash->ctx, (const unsigned char *)arrHash->words, sizeof(arrHash->words));
         }
+        sha3_Update(&arrHash->ctx, (const unsigned char *)word, 32);
     }
-    if (ctr == MAX_USERDEF_TYPES) {
-        return TOO_MANY_UDEFS;
+    arrHash->count++;
+}
+
+void arrayHashFinal(arrayHash *arrHash, uint8_t *hashRet) {
+    if (arrHash->count > ARRAY_HASH_WORDS) {
+        keccak_Final(&arrHash->ctx, hashRet);
+    } else if (arrHash->count == 1) {
+        keccak256_32(arrHash->words, hashRet);
+    } else if (arrHash->count == 2) {
+        keccak256_64(arrHash->words, hashRet);
+    } else {
+        keccak256_words(arrHash->words, arrHash->count, hashRet);
     }
+}
+
+void eip712_ctx_init(eip712_ctx *ctx) {
+    memzero(ctx, sizeof(eip712_ctx));
+}
 
-    return NOT_ENCODABLE; // not encodable
+void eip712_clear_cache(eip712_ctx *ctx) {
+    ctx->planReady = 0;
+}
+
+void clearTypeHashCache(void) {
+    eip712_clear_cache(&defaultCtx);
 }
 
 /*
-    Entry: 
-            eip712Types points to eip712 json type structure to parse
-            typeS points to the type to parse from jType
-            typeStr points to caller allocated, zeroized string buffer of size STRBUFSIZE+1
-    Exit:  
-            typeStr points to hashable type string
+    Entry:
+            ctx points to the encoder context
+            plan points to the plan being compiled, fields resolved
+            eip712Types points to the eip712 types structure
+            type points to the plan type to hash
+            typeHash points to caller allocated 32 byte buffer
+    Exit:
+            typeHash holds keccak of the hashable type string of type
             returns error list status
-
-    NOTE: reentrant!
 */
-int parseType(const json_t *eip712Types, const char *typeS, char *typeStr) {
-    json_t const *tarray, *pairs;
-    const json_t *jType;
-    char append[STRBUFSIZE+1] = {0};
-    int encTest;
-    const char *typeType = NULL;
-    int errRet = SUCCESS;
-    const json_t *obTest;
-    const char *nameTest;
-    const char *pVal;
+int getTypeHash(eip712_ctx *ctx, const eip712Plan *plan, const json_t *eip712Types, const planType *type,
+                uint8_t *typeHash) {
+    struct SHA3_CTX typeCtx;
+    int errRet;
 
-    if (NULL == (jType = json_getProperty(eip712Types, typeS))) {
-        errRet = JSON_TYPE_S_ERR;
+    sha3_256_Init(&typeCtx);
+    if (SUCCESS != (errRet = parseType(ctx, plan, eip712Types, type, &typeCtx))) {
         return errRet;
     }
+    keccak_Final(&typeCtx, typeHash);
+    return SUCCESS;
+}
 
-    if (NULL == (nameTest = json_getName(jType))) {
-        errRet = JSON_TYPE_S_NAMEERR;
-        return errRet;
+// Value of a hex digit, 0xFF if chr is not one
+uint8_t hexNibble(unsigned char chr) {
+    if ((unsigned)(chr - '0') < 10) {
+        return chr - '0';
     }
+    chr |= 0x20;
+    if ((unsigned)(chr - 'a') < 6) {
+        return chr - 'a' + 10;
+    }
+    return 0xFF;
+}
 
-    strncat(typeStr, nameTest, STRBUFSIZE - strlen((const char *)typeStr));
-    strncat(typeStr, "(", STRBUFSIZE - strlen((const char *)typeStr));
-
-    tarray = json_getChild(jType);
-    while (tarray != 0) {
-        if (NULL == (pairs = json_getChild(tarray))) {
-            errRet = JSON_NO_PAIRS;
-            return errRet;
-        }
-        // should be type JSON_TEXT
-        if (pairs->type != JSON_TEXT) {
-            errRet = JSON_PAIRS_NOTEXT;
-            return errRet;
-        } else {
-            if (NULL == (obTest = json_getSibling(pairs))) {
-                errRet = JSON_NO_PAIRS_SIB;
-                return errRet;
-            }
-            typeType = json_getValue(obTest);
-            encTest = encodableType(typeType);
-            if (encTest == UDEF_TYPE) {
-                //This is a user-defined type, parse it and append later
-                if (']' == typeType[strlen(typeType)-1]) {
-                    // array of structs. To parse name, remove array tokens.
-                    char typeNoArrTok[MAX_TYPESTRING] = {0};
-                    strncpy(typeNoArrTok, typeType, sizeof(typeNoArrTok)-1);
-                    if (strlen(typeNoArrTok) < strlen(typeType)) {
-                        return UDEF_NAME_ERROR;
-                    }
-
-                    strtok(typeNoArrTok, "[");
-                    if (SUCCESS != (errRet = memcheck())) {
-                        return errRet;
-                    }
-                    if (SUCCESS != (errRet = parseType(eip712Types, typeNoArrTok, append))) {
-                        return errRet;
-                    }
-                } else {
-                    if (SUCCESS != (errRet = memcheck())) {
-                        return errRet;
-                    }
-                    if (SUCCESS != (errRet = parseType(eip712Types, typeType, append))) {
-                        return errRet;
-                    }
-                }
-            } else if (encTest == TOO_MANY_UDEFS) {
-                return UDEFS_OVERFLOW;
-            } else if (encTest == NOT_ENCODABLE) {
-                return TYPE_NOT_ENCODABLE;
-            }
+/*
+    Entry:
+            hex points to len hex digits, no "0x"
+            out points to caller allocated buffer of len/2 bytes
+    Exit:
+            out holds the decoded bytes
+            returns SUCCESS, or HEX_STRING_ERROR if len is odd or a character is not a hex digit
+
+    With AVX2 or SSE2 32 or 16 digits are checked and decoded per step, the scalar loop does
+    the rest and targets without them.
+*/
+int hexDecode(const char *hex, size_t len, uint8_t *out) {
+    uint8_t hi, lo;
 
-            if (NULL == (pVal = json_getValue(pairs))) {
-                errRet = JSON_NOPAIRVAL;
-                return errRet;
-            }
-            strncat(typeStr, typeType, STRBUFSIZE - strlen((const char *)typeStr));
-            strncat(typeStr, " ", STRBUFSIZE - strlen((const char *)typeStr));
-            strncat(typeStr, pVal, STRBUFSIZE - strlen((const char *)typeStr));
-            strncat(typeStr, ",", STRBUFSIZE - strlen((const char *)typeStr));
-            
+    if (len % 2) {
+        return HEX_STRING_ERROR;
+    }
+#ifdef __AVX2__
+    for (; len >= 32; hex += 32, len -= 32, out += 16) {
+        __m256i chr = _mm256_loadu_si256((const __m256i *)(const void *)hex);
+        __m256i lower = _mm256_or_si256(chr, _mm256_set1_epi8(0x20));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(chr, _mm256_set1_epi8('0'-1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), chr));
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a'-1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('f'+1), lower));
+        __m256i nibbles, bytes;
+
+        if (-1 != _mm256_movemask_epi8(_mm256_or_si256(digit, alpha))) {
+            return HEX_STRING_ERROR;
         }
-        tarray = json_getSibling(tarray);
+        nibbles = _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(chr, _mm256_set1_epi8('0'))),
+                                  _mm256_and_si256(alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a'-10))));
+        // 16 bit lanes hold a digit pair, first digit in the low byte
+        bytes = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(nibbles, 4), _mm256_set1_epi16(0xF0)),
+                                _mm256_srli_epi16(nibbles, 8));
+        // packs within 128 bit lanes, bring the two 8 byte halves together
+        bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0xD8);
+        _mm_storeu_si128((__m128i *)(void *)out, _mm256_castsi256_si128(bytes));
     }
-    // typeStr ends with a ',' unless there are no parameters to the type.
-    if (typeStr[strlen(typeStr)-1] == ',') {
-        // replace last comma with a paren
-        typeStr[strlen(typeStr)-1] = ')';
-    } else {
-        // append paren, there are no parameters
-        strncat(typeStr, ")", STRBUFSIZE - 1);
+#endif
+#ifdef __SSE2__
+    for (; len >= 16; hex += 16, len -= 16, out += 8) {
+        __m128i chr = _mm_loadu_si128((const __m128i *)(const void *)hex);
+        __m128i lower = _mm_or_si128(chr, _mm_set1_epi8(0x20));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chr, _mm_set1_epi8('0'-1)),
+                                      _mm_cmplt_epi8(chr, _mm_set1_epi8('9'+1)));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('f'+1)));
+        __m128i nibbles, bytes;
+
+        if (0xFFFF != _mm_movemask_epi8(_mm_or_si128(digit, alpha))) {
+            return HEX_STRING_ERROR;
+        }
+        nibbles = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(chr, _mm_set1_epi8('0'))),
+                               _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a'-10))));
+        bytes = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nibbles, 4), _mm_set1_epi16(0xF0)),
+                             _mm_srli_epi16(nibbles, 8));
+        _mm_storel_epi64((__m128i *)(void *)out, _mm_packus_epi16(bytes, bytes));
     }
-    if (strlen(append) > 0) {
-        strncat(typeStr, append, STRBUFSIZE - strlen((const char *)append));
+#endif
+    for (; len > 0; hex += 2, len -= 2) {
+        hi = hexNibble((unsigned char)hex[0]);
+        lo = hexNibble((unsigned char)hex[1]);
+        if (hi > 0x0F || lo > 0x0F) {
+            return HEX_STRING_ERROR;
+        }
+        *out++ = (uint8_t)(hi << 4 | lo);
     }
-
     return SUCCESS;
 }
 
-int encAddress(const char *string, uint8_t *encoded) {
-    unsigned ctr;
-    char byteStrBuf[3] = {0};
+// 1 if string starts with "0x" or "0X"
+bool hexPrefix(const char *string) {
+    return string[0] == '0' && (string[1] | 0x20) == 'x';
+}
 
+int encAddress(const char *string, uint8_t *encoded) {
     if (string == NULL) {
         return ADDR_STRING_NULL;
     }
     if (ADDRESS_SIZE < strlen(string)) {
         return ADDR_STRING_VFLOW;
     }
-
-    for (ctr=0; ctr<12; ctr++) {
-        encoded[ctr] = '\0';
+    if (ADDRESS_SIZE != strlen(string) || !hexPrefix(string)) {
+        return HEX_STRING_ERROR;
     }
-    for (ctr=12; ctr<32; ctr++) {
-        strncpy(byteStrBuf, &string[2*((ctr-12))+2], 2);
-        encoded[ctr] = (uint8_t)(strtol(byteStrBuf, NULL, 16));
-    }
-    return SUCCESS;
+
+    memset(encoded, 0, 12);
+    return hexDecode(&string[2], ADDRESS_SIZE-2, &encoded[12]);
 }
 
 int encString(const char *string, uint8_t *encoded) {
@@ -263,82 +322,255 @@ int encString(const char *string, uint8_t *encoded) {
 
 int encodeBytes(const char *string, uint8_t *encoded) {
     struct SHA3_CTX byteCtx;
-    const char *valStrPtr = string+2;
-    uint8_t valByte[1];
-    char byteStrBuf[3] = {0};
+    // whole keccak blocks in 64 bit words, sha3_Update() absorbs these in place
+    uint64_t decoded[BYTES_CHUNK_BLOCKS*SHA3_256_BLOCK_LENGTH/sizeof(uint64_t)];
+    size_t len, chunk;
+    int errRet;
+
+    if (string == NULL || !hexPrefix(string)) {
+        return HEX_STRING_ERROR;
+    }
+    string += 2;
+    len = strlen(string);
+    if (len % 2) {
+        return HEX_STRING_ERROR;
+    }
 
     sha3_256_Init(&byteCtx);
-    while (*valStrPtr != '\0') {
-        strncpy(byteStrBuf, valStrPtr, 2);
-        valByte[0] = (uint8_t)(strtol(byteStrBuf, NULL, 16));
-        sha3_Update(&byteCtx, 
-                    (const unsigned char *)valByte, 
-                    (size_t)sizeof(uint8_t));
-        valStrPtr+=2;
+    for (; len > 0; string += chunk, len -= chunk) {
+        chunk = len < 2*sizeof(decoded) ? len : 2*sizeof(decoded);
+        if (SUCCESS != (errRet = hexDecode(string, chunk, (uint8_t *)decoded))) {
+            return errRet;
+        }
+        sha3_Update(&byteCtx, (const unsigned char *)decoded, chunk/2);
     }
     keccak_Final(&byteCtx, encoded);
     return SUCCESS;
 }
 
-int encodeBytesN(const char *typeT, const char *string, uint8_t *encoded) {
-    char byteStrBuf[3] = {0};
-    unsigned ctr;
-
-    if (MAX_ENCBYTEN_SIZE < strlen(string)) {
+int encodeBytesN(unsigned byteTypeSize, const char *string, uint8_t *encoded) {
+    if (string == NULL || MAX_ENCBYTEN_SIZE < strlen(string)) {
         return BYTESN_STRING_ERROR;
     }
 
-    // parse out the length val
-    uint8_t byteTypeSize = (uint8_t)(strtol((typeT+5), NULL, 10));
     if (32 < byteTypeSize) {
         return BYTESN_SIZE_ERROR;
     }
-    for (ctr=0; ctr<32; ctr++) {
-        // zero padding
-        encoded[ctr] = 0;
+    if (!hexPrefix(string)) {
+        return HEX_STRING_ERROR;
     }
-    unsigned zeroFillLen = 32 - ((strlen(string)-2/* skip '0x' */)/2);
     // bytesN are zero padded on the right
-    for (ctr=zeroFillLen; ctr<32; ctr++) {
-        strncpy(byteStrBuf, &string[2+2*(ctr-zeroFillLen)], 2);
-        encoded[ctr-zeroFillLen] = (uint8_t)(strtol(byteStrBuf, NULL, 16));
+    memset(encoded, 0, 32);
+    return hexDecode(&string[2], strlen(string)-2, encoded);
+}
+
+// num = num * mul + add, num is 8 words least significant first. Returns the carry out.
+uint32_t mulAddWords(uint32_t num[8], uint32_t mul, uint32_t add) {
+    uint64_t acc = add;
+    unsigned ctr;
+
+    for (ctr=0; ctr<8; ctr++) {
+        acc += (uint64_t)num[ctr] * mul;
+        num[ctr] = (uint32_t)acc;
+        acc >>= 32;
+    }
+    return (uint32_t)acc;
+}
+
+/*
+    Entry:
+            string is a decimal or "0x" hex integer with optional '-'. Decimals may be
+            json numbers with fraction and exponent, e.g. "1e+21", if their value is whole.
+            byteSize is the intN/uintN width in bytes
+            isSigned is 1 for intN
+            encoded points to caller allocated 32 byte buffer
+    Exit:
+            encoded holds the big endian two's complement value
+            returns INT_STRING_ERROR if string is not an integer, INT_RANGE_ERROR if the
+            value does not fit the width
+
+    Decimals are added nine digits at a time into 32 bit words, hex digits are placed
+    straight into their word.
+*/
+int encodeInt(const char *string, unsigned byteSize, bool isSigned, uint8_t *encoded) {
+    uint32_t num[8] = {0};
+    uint32_t chunk = 0, chunkMul = 1, carry = 0;
+    const char *digits, *end, *mantEnd;
+    bool negative = 0, expNegative = 0;
+    long exponent = 0;
+    unsigned ctr, top, total, fracLen = 0;
+    unsigned char chr;
+
+    if (NULL == string) {
+        return INT_STRING_ERROR;
+    }
+    if (0 == byteSize || 32 < byteSize) {
+        return INT_RANGE_ERROR;
+    }
+    if (*string == '-') {
+        negative = 1;
+        string++;
+    }
+
+    if (string[0] == '0' && (string[1] == 'x' || string[1] == 'X')) {
+        for (end = string+2; isxdigit((unsigned char)*end); end++);
+        if (*end != '\0' || end == string+2) {
+            return INT_STRING_ERROR;
+        }
+        for (digits = string+2; *digits == '0'; digits++);
+        if (end - digits > 64) {
+            return INT_RANGE_ERROR;
+        }
+        // least significant digit first
+        for (ctr=0; end > digits; ctr++) {
+            chr = (unsigned char)*--end;
+            chr = isdigit(chr) ? chr - '0' : (chr | 0x20) - 'a' + 10;
+            num[ctr/8] |= (uint32_t)chr << (4*(ctr%8));
+        }
+    } else {
+        for (end = string; isdigit((unsigned char)*end); end++);
+        total = end - string;
+        if (*end == '.') {
+            for (digits = ++end; isdigit((unsigned char)*end); end++);
+            fracLen = end - digits;
+            total += fracLen;
+        }
+        mantEnd = end;
+        if (0 == total) {
+            return INT_STRING_ERROR;
+        }
+        if (*end == 'e' || *end == 'E') {
+            end++;
+            if (*end == '+' || *end == '-') {
+                expNegative = (*end++ == '-');
+            }
+            if (!isdigit((unsigned char)*end)) {
+                return INT_STRING_ERROR;
+            }
+            for (; isdigit((unsigned char)*end); end++) {
+                // anything past 1e100 overflows anyway
+                if (exponent < 100) {
+                    exponent = exponent*10 + (*end - '0');
+                }
+            }
+            if (expNegative) {
+                exponent = -exponent;
+            }
+        }
+        if (*end != '\0') {
+            return INT_STRING_ERROR;
+        }
+
+        // digits shifted out by a negative exponent must be zero
+        exponent -= fracLen;
+        for (digits = string, ctr = 0; digits < mantEnd; digits++) {
+            if (*digits == '.') {
+                continue;
+            }
+            if (exponent < 0 && (long)ctr++ >= (long)total + exponent) {
+                if (*digits != '0') {
+                    return INT_STRING_ERROR;
+                }
+                continue;
+            }
+            chunk = chunk*10 + (*digits - '0');
+            chunkMul *= 10;
+            if (chunkMul == 1000000000) {
+                carry |= mulAddWords(num, chunkMul, chunk);
+                chunk = 0;
+                chunkMul = 1;
+            }
+        }
+        carry |= mulAddWords(num, chunkMul, chunk);
+        for (; exponent > 0; exponent -= 9) {
+            for (chunkMul = 1, ctr = 0; ctr < 9 && (long)ctr < exponent; ctr++) {
+                chunkMul *= 10;
+            }
+            carry |= mulAddWords(num, chunkMul, 0);
+        }
+        if (carry) {
+            return INT_RANGE_ERROR;
+        }
+    }
+
+    for (ctr=0; ctr<32; ctr++) {
+        encoded[31-ctr] = (uint8_t)(num[ctr/4] >> (8*(ctr%4)));
+    }
+
+    // the magnitude must fit the width, intN allows one more below zero than above
+    top = 32 - byteSize;
+    for (ctr=0; ctr<top; ctr++) {
+        if (encoded[ctr] != 0) {
+            return INT_RANGE_ERROR;
+        }
+    }
+    if (isSigned && (encoded[top] & 0x80)) {
+        if (!negative || encoded[top] != 0x80) {
+            return INT_RANGE_ERROR;
+        }
+        for (ctr=top+1; ctr<32; ctr++) {
+            if (encoded[ctr] != 0) {
+                return INT_RANGE_ERROR;
+            }
+        }
+    }
+
+    if (negative) {
+        for (ctr=0; ctr<32 && !isSigned; ctr++) {
+            if (encoded[ctr] != 0) {
+                return INT_RANGE_ERROR;
+            }
+        }
+        carry = 1;
+        for (ctr=32; ctr-- > 0; ) {
+            carry += (uint8_t)~encoded[ctr];
+            encoded[ctr] = (uint8_t)carry;
+            carry >>= 8;
+        }
     }
     return SUCCESS;
 }
 
-int confirmName(const char *name, bool valAvailable) {
+int confirmName(eip712_ctx *ctx, const char *name, bool valAvailable) {
+    if (ctx->skipConfirm) {
+        // nothing to confirm, leaves ctx untouched so elements can be encoded concurrently
+        return SUCCESS;
+    }
     if (valAvailable) {
-        nameForValue = name;
+        ctx->nameForValue = name;
     } else {
         (void)review(ButtonRequestType_ButtonRequest_Other, "MESSAGE DATA", "Press button to continue for\n\"%s\" values", name);
     }
     return SUCCESS;
 }
 
-int confirmValue(const char *value) {
-    (void)review(ButtonRequestType_ButtonRequest_Other, "MESSAGE DATA", "%s %s", nameForValue, value);
+int confirmValue(eip712_ctx *ctx, const char *value) {
+    if (!ctx->skipConfirm) {
+        (void)review(ButtonRequestType_ButtonRequest_Other, "MESSAGE DATA", "%s %s", ctx->nameForValue, value);
+    }
     return SUCCESS;
 }
 
-static const char *dsname=NULL, *dsversion=NULL, *dschainId=NULL, *dsverifyingContract=NULL;
-void marshallDsVals(const char *value) {
-
-    if (0 == strncmp(nameForValue, "name", sizeof("name"))) {
-        dsname = value;
+void marshallDsVals(eip712_ctx *ctx, const char *value) {
+    if (ctx->skipConfirm) {
+        return;
     }
-    if (0 == strncmp(nameForValue, "version", sizeof("version"))) {
-        dsversion = value;
+    if (0 == strncmp(ctx->nameForValue, "name", sizeof("name"))) {
+        ctx->dsname = value;
     }
-    if (0 == strncmp(nameForValue, "chainId", sizeof("chainId"))) {
-        dschainId = value;
+    if (0 == strncmp(ctx->nameForValue, "version", sizeof("version"))) {
+        ctx->dsversion = value;
     }
-    if (0 == strncmp(nameForValue, "verifyingContract", sizeof("verifyingContract"))) {
-        dsverifyingContract = value;
+    if (0 == strncmp(ctx->nameForValue, "chainId", sizeof("chainId"))) {
+        ctx->dschainId = value;
+    }
+    if (0 == strncmp(ctx->nameForValue, "verifyingContract", sizeof("verifyingContract"))) {
+        ctx->dsverifyingContract = value;
     }
     return;
 }
 
-void dsConfirm(void) {
+void dsConfirm(eip712_ctx *ctx) {
     // First check if we recognize the contract
     const TokenType *assetToken;
     uint8_t addrHexStr[20] = {0};
@@ -353,31 +585,35 @@ void dsConfirm(void) {
     char chainStr[33] = {0};
     char verifyingContract[65] = {0};
 
-    if (dsname != NULL) {
-        strncpy(name, dsname, 40);
+    if (ctx->skipConfirm) {
+        // no values were marshalled
+        return;
+    }
+    if (ctx->dsname != NULL) {
+        strncpy(name, ctx->dsname, 40);
     }
-    if (dsversion != NULL) {
-        strncpy(version, dsversion, 10);
+    if (ctx->dsversion != NULL) {
+        strncpy(version, ctx->dsversion, 10);
     }
 
-    if (dsverifyingContract != NULL) {
+    if (ctx->dsverifyingContract != NULL) {
         for (ctr=2; ctr<42; ctr+=2) {
-            sscanf((char *)&dsverifyingContract[ctr], "%2hhx", &addrHexStr[(ctr-2)/2]);
+            sscanf((char *)&ctx->dsverifyingContract[ctr], "%2hhx", &addrHexStr[(ctr-2)/2]);
         }
         strcat(verifyingContract, "Verifying Contract: ");
-        strncat(verifyingContract, dsverifyingContract, sizeof(verifyingContract) - sizeof("Verifying Contract: "));
+        strncat(verifyingContract, ctx->dsverifyingContract, sizeof(verifyingContract) - sizeof("Verifying Contract: "));
     }
 
-    if (NULL != dschainId) {
+    if (NULL != ctx->dschainId) {
         noChain = false;
-        sscanf((char *)dschainId, "%ld", &chainInt);
+        sscanf((char *)ctx->dschainId, "%ld", &chainInt);
         // As more chains are supported, add icon choice below
         // TBD: not implemented for first release
         // if (chainInt == 1) {
         //     iconNum = ETHEREUM_ICON;
         // }
     }
-    if (noChain == false && dsverifyingContract != NULL) {
+    if (noChain == false && ctx->dsverifyingContract != NULL) {
         assetToken = tokenByChainAddress(chainInt, (uint8_t *)addrHexStr);
         if (strncmp(assetToken->ticker, " UNKN", 5) == 0) {
             fillerStr = "";
@@ -389,392 +625,759 @@ void dsConfirm(void) {
     }
 
     strncpy(title, name, 40);
-    if (NULL != dsversion) {
+    if (NULL != ctx->dsversion) {
         strncat(title, " Ver: ", 63-strlen(title));
         strncat(title, version, 63-strlen(title));
     }
-    if (NULL != dschainId) {
-        snprintf(chainStr, 32, "chain %s,  ", dschainId);
+    if (NULL != ctx->dschainId) {
+        snprintf(chainStr, 32, "chain %s,  ", ctx->dschainId);
     }
     //snprintf(contractStr, 64, "verifyingContract: %s", verifyingContract);
     (void)review_with_icon(ButtonRequestType_ButtonRequest_Other, iconNum,
                             title, "%s %s%s", chainStr, verifyingContract, fillerStr);
-    dsname = NULL;
-    dsversion = NULL;
-    dschainId = NULL;
-    dsverifyingContract = NULL;
+    ctx->dsname = NULL;
+    ctx->dsversion = NULL;
+    ctx->dschainId = NULL;
+    ctx->dsverifyingContract = NULL;
+}
+
+int parseVals(eip712_ctx *ctx, encodeFrame *frames, unsigned maxFrames, const eip712Plan *plan,
+              const planType *type, const json_t *nextVal, struct SHA3_CTX *msgCtx);
+
+#ifdef EIP712_HOST
+// The elements of one struct array handed to ctx->parallelFor
+typedef struct {
+    eip712_ctx *ctx;
+    const eip712Plan *plan;
+    const planType *type;
+    unsigned maxFrames;             // frames available to each element
+    unsigned workers;               // entries of frames
+    const json_t **vals;            // elements in array order
+    uint8_t (*hashes)[32];
+    int *status;
+    encodeFrame **frames;           // frame stack of each worker, allocated by its first element
+} elementBatch;
+
+void encodeElement(void *arg, unsigned worker, size_t idx) {
+    elementBatch *batch = (elementBatch *)arg;
+    struct SHA3_CTX eleCtx;
+
+    if (worker >= batch->workers) {
+        batch->status[idx] = GENERAL_ERROR;
+        return;
+    }
+    // only the frames left below the array, and off the C stack: nested struct arrays come
+    // back here through parseVals(). A worker runs one element at a time, so it reuses them.
+    if (NULL == batch->frames[worker] &&
+        NULL == (batch->frames[worker] = malloc(batch->maxFrames * sizeof(encodeFrame)))) {
+        batch->status[idx] = GENERAL_ERROR;
+        return;
+    }
+    sha3_256_Init(&eleCtx);
+    sha3_Update(&eleCtx, (const unsigned char *)batch->type->typeHash, 32);
+    batch->status[idx] = parseVals(batch->ctx, batch->frames[worker], batch->maxFrames, batch->plan,
+                                   batch->type, json_getChild(batch->vals[idx]), &eleCtx);
+    if (SUCCESS == batch->status[idx]) {
+        keccak_Final(&eleCtx, batch->hashes[idx]);
+    }
+}
+
+/*
+    Entry:
+            ctx points to the encoder context, with parallelFor set and skipConfirm on
+            maxFrames is the number of frames each element may use
+            plan points to the compiled types
+            type points to the plan type of the elements
+            udefVals points to the first element
+            arrHash points to initialized array hash
+    Exit:
+            element hashes are added to arrHash in array order
+            returns error list status of the first failing element, or SUCCESS
+
+    The whole array goes to one parallelFor call. Each worker gets one frame stack of
+    maxFrames frames from the heap, reused for all the elements it encodes. Only called when
+    ctx->parallelFor is set, which hosted builds alone do, keeping the allocations away from
+    other callers.
+*/
+int parallelElements(eip712_ctx *ctx, unsigned maxFrames, const eip712Plan *plan, const planType *type,
+                     const json_t *udefVals, arrayHash *arrHash) {
+    elementBatch batch;
+    const json_t *walkVals;
+    size_t count = 0, ctr;
+    int errRet = SUCCESS;
+
+    if (0 == maxFrames) {
+        return RECURSION_ERROR;
+    }
+    for (walkVals = udefVals; 0 != walkVals; walkVals = json_getSibling(walkVals)) {
+        if (JSON_OBJ != json_getType(walkVals)) {
+            return ARRAY_VALUE_ERROR;
+        }
+        count++;
+    }
+
+    batch.ctx = ctx;
+    batch.plan = plan;
+    batch.type = type;
+    batch.maxFrames = maxFrames;
+    batch.workers = ctx->parallelWorkers ? ctx->parallelWorkers : 1;
+    batch.vals = malloc(count * sizeof(*batch.vals));
+    batch.hashes = malloc(count * sizeof(*batch.hashes));
+    batch.status = malloc(count * sizeof(*batch.status));
+    batch.frames = calloc(batch.workers, sizeof(*batch.frames));
+    if (NULL == batch.vals || NULL == batch.hashes || NULL == batch.status || NULL == batch.frames) {
+        errRet = GENERAL_ERROR;
+    } else {
+        for (ctr=0, walkVals=udefVals; ctr<count; ctr++, walkVals=json_getSibling(walkVals)) {
+            batch.vals[ctr] = walkVals;
+        }
+        ctx->parallelFor(ctx->parallelArg, count, encodeElement, &batch);
+        for (ctr=0; ctr<count; ctr++) {
+            if (SUCCESS != (errRet = batch.status[ctr])) {
+                break;
+            }
+            arrayHashAdd(arrHash, batch.hashes[ctr]);
+        }
+    }
+
+    if (NULL != batch.frames) {
+        for (ctr=0; ctr<batch.workers; ctr++) {
+            free(batch.frames[ctr]);
+        }
+    }
+    free(batch.frames);
+    free(batch.status);
+    free(batch.hashes);
+    free(batch.vals);
+    return errRet;
+}
+#endif
+
+/*
+    Entry:
+            ctx points to the encoder context
+            field points to the plan field to encode, any kind but UDEF_TYPE
+            valStr is the value string, of the field or of one element of an array field
+            ds_vals is 1 when the field is part of the domain
+            encBytes points to caller allocated 32 byte buffer
+    Exit:
+            encBytes holds the encoded value
+            returns error list status
+*/
+int encodeField(eip712_ctx *ctx, const planField *field, const char *valStr, bool ds_vals, uint8_t *encBytes) {
+    int errRet = SUCCESS;
+
+    if (ds_vals) {
+        marshallDsVals(ctx, valStr);
+    } else {
+        confirmValue(ctx, valStr);
+    }
+    switch (field->kind) {
+        case ADDRESS:
+            errRet = encAddress(valStr, encBytes);
+            break;
+
+        case STRING:
+            if (NULL == valStr) {
+                return JSON_NOPAIRVAL;
+            }
+            errRet = encString(valStr, encBytes);
+            break;
+
+        case UINT:
+        case INT:
+            errRet = encodeInt(valStr, field->size, field->isSigned, encBytes);
+            break;
+
+        case BYTES:
+            // 'bytes', hashed
+            errRet = encodeBytes(valStr, encBytes);
+            break;
+
+        case BYTES_N:
+            // 'bytes1', ..., 'bytes32'
+            errRet = encodeBytesN(field->size, valStr, encBytes);
+            break;
+
+        case BOOL:
+            // leading zeros in bool
+            memset(encBytes, 0, 32);
+            if (NULL != valStr && 0 == strncmp(valStr, "true", sizeof("true"))) {
+                encBytes[31] = 0x01;
+            }
+            break;
+
+        default:
+            return TYPE_NOT_ENCODABLE;
+    }
+    return errRet;
+}
+
+// FNV-1a hash of a field name
+uint32_t nameHash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#ifdef EIP712_HOST
+/*
+    Builds the value index of frame. tiny-json allocates the values of an object from its
+    pool after the first one, so each is stored as its offset from frame->vals.
+    Returns 0 if the values do not fit the index.
+*/
+int indexValues(encodeFrame *frame) {
+    const json_t *walkVals;
+    unsigned slot, count = 0;
+
+    memset(frame->valueIndex, 0xFF, sizeof(frame->valueIndex));
+    for (walkVals = frame->vals; 0 != walkVals; walkVals = json_getSibling(walkVals)) {
+        if (++count > VALUE_INDEX_SLOTS*3/4 || walkVals < frame->vals ||
+            walkVals - frame->vals >= VALUE_INDEX_EMPTY || NULL == json_getName(walkVals)) {
+            return 0;
+        }
+        // a repeated name lands further along the probe sequence, so the first one is found
+        slot = nameHash(json_getName(walkVals)) & (VALUE_INDEX_SLOTS-1);
+        while (VALUE_INDEX_EMPTY != frame->valueIndex[slot]) {
+            slot = (slot + 1) & (VALUE_INDEX_SLOTS-1);
+        }
+        frame->valueIndex[slot] = (uint16_t)(walkVals - frame->vals);
+    }
+    return 1;
+}
+#endif
+
+/*
+    Entry:
+            frame points to the frame of the struct being encoded, its values are the
+            members of a json object so all have names
+            plan points to the compiled types
+            field points to the plan field to find the value of
+    Exit:
+            returns the value named like field, 0 if there is none
+
+    Values usually come in field order and are found right after the previous one. Otherwise
+    structs with many fields get a value index on EIP712_HOST builds, others walk their values.
+    A repeated name gives its first value either way: nextVal is only used while all values
+    before it belong to earlier fields, and those have other names when the type's are unique.
+*/
+const json_t *findValue(encodeFrame *frame, const eip712Plan *plan, const planField *field) {
+    const char *name = &plan->strings[field->name];
+    const json_t *walkVals = frame->nextVal;
+#ifdef EIP712_HOST
+    unsigned slot;
+#endif
+
+    if (!frame->inOrder || !frame->type->uniqueNames || 0 == walkVals ||
+        0 != strcmp(json_getName(walkVals), name)) {
+        frame->inOrder = 0;
+#ifdef EIP712_HOST
+        if (VALUE_INDEX_NONE == frame->indexState) {
+            frame->indexState = (frame->type->numFields >= VALUE_INDEX_MIN_FIELDS && indexValues(frame)) ?
+                                VALUE_INDEX_BUILT : VALUE_INDEX_WALK;
+        }
+        if (VALUE_INDEX_BUILT == frame->indexState) {
+            walkVals = 0;
+            for (slot = field->nameHash & (VALUE_INDEX_SLOTS-1); VALUE_INDEX_EMPTY != frame->valueIndex[slot];
+                 slot = (slot + 1) & (VALUE_INDEX_SLOTS-1)) {
+                if (0 == strcmp(json_getName(frame->vals + frame->valueIndex[slot]), name)) {
+                    walkVals = frame->vals + frame->valueIndex[slot];
+                    break;
+                }
+            }
+        } else
+#endif
+        {
+            walkVals = frame->vals;
+            while (0 != walkVals && 0 != strcmp(json_getName(walkVals), name)) {
+                // keep looking for val
+                walkVals = json_getSibling(walkVals);
+            }
+        }
+    }
+    if (0 != walkVals) {
+        frame->nextVal = json_getSibling(walkVals);
+    }
+    return walkVals;
+}
+
+// Starts a frame for a struct value, its hash begins with the typehash. The 32 typehash bytes
+// only fill the block buffer, so absorbing them per element costs no more than cloning a
+// midstate would, and needs no extra SHA3_CTX per frame.
+int pushStruct(encodeFrame *frames, unsigned maxFrames, unsigned *depth, const planType *type,
+               const json_t *vals) {
+    encodeFrame *frame;
+
+    if (*depth + 1 >= maxFrames) {
+        return RECURSION_ERROR;
+    }
+    frame = &frames[++(*depth)];
+    frame->type = type;
+    frame->vals = vals;
+    frame->nextVal = vals;
+    frame->inOrder = 1;
+    frame->indexState = VALUE_INDEX_NONE;
+    frame->inArray = 0;
+    frame->dims = 0;
+    frame->elements = NULL;
+    frame->element = NULL;
+    frame->field = 0;
+    frame->hash = &frame->ctxBuf;
+    sha3_256_Init(frame->hash);
+    sha3_Update(frame->hash, (const unsigned char *)type->typeHash, 32);
+    return SUCCESS;
+}
+
+// Starts a frame for an inner array, of dims dimensions, of an array field
+int pushArray(encodeFrame *frames, unsigned maxFrames, unsigned *depth, const planField *field,
+              unsigned dims, const json_t *array) {
+    encodeFrame *frame;
+
+    if (JSON_ARRAY != json_getType(array)) {
+        return ARRAY_VALUE_ERROR;
+    }
+    if (*depth + 1 >= maxFrames) {
+        return RECURSION_ERROR;
+    }
+    frame = &frames[++(*depth)];
+    frame->type = NULL;
+    frame->vals = NULL;
+    frame->inArray = 1;
+    frame->dims = dims;
+    frame->elements = field;
+    frame->element = json_getChild(array);
+    arrayHashInit(&frame->arrHash);
+    return SUCCESS;
 }
 
 /*
     Entry: 
-            eip712Types points to the eip712 types structure
-            jType points to eip712 json type structure to parse
+            ctx points to the encoder context
+            frames points to caller allocated stack of maxFrames frames
+            plan points to the compiled types
+            type points to the plan type to encode
             nextVal points to the next value to encode
             msgCtx points to caller allocated hash context to hash encoded values into.
     Exit:  
             msgCtx points to current final hash context
-            returns error status
+            returns error status, RECURSION_ERROR if the values nest deeper than maxFrames
+
+    Struct values do not recurse. A struct field pushes a frame for the child struct; when
+    all its fields are encoded the frame is popped and its hash becomes the value of the
+    parent field, or an element of the parent's array.
 
-    NOTE: reentrant!
+    The frame of a struct walks the outer dimension of its array fields itself. Every inner
+    array gets a frame of its own, scalar elements are encoded as they are walked.
 */
-int parseVals(const json_t *eip712Types, const json_t *jType, const json_t *nextVal, struct SHA3_CTX *msgCtx) {
-    json_t const *tarray, *pairs, *walkVals, *obTest;
-    int ctr;
-    const char *typeName = NULL, *typeType = NULL;
+int parseVals(eip712_ctx *ctx, encodeFrame *frames, unsigned maxFrames, const eip712Plan *plan,
+              const planType *type, const json_t *nextVal, struct SHA3_CTX *msgCtx) {
+    encodeFrame *frame;
+    const planField *field;
+    const planType *child = NULL;
+    json_t const *walkVals;
+    const char *typeName = NULL;
     uint8_t encBytes[32] = {0};     // holds the encrypted bytes for the message
-    const char *valStr = NULL;
-    struct SHA3_CTX valCtx = {0};   // local hash context
     bool hasValue = 0;
-    bool ds_vals = 0;           // domain sep values are confirmed on a single screen
     int errRet = SUCCESS;
+    unsigned depth = 0, dims;
 
-    if (0 == strncmp(json_getName(jType), "EIP712Domain", sizeof("EIP712Domain"))) {
-        ds_vals = true;
+    if (maxFrames == 0) {
+        return RECURSION_ERROR;
     }
-
-    tarray = json_getChild(jType);
-
-    while (tarray != 0) {
-        if (NULL == (pairs = json_getChild(tarray))) {
-            errRet = JSON_NO_PAIRS;
-            return errRet;
-        }
-        // should be type JSON_TEXT
-        if (pairs->type != JSON_TEXT) {
-            errRet = JSON_PAIRS_NOTEXT;
-            return errRet;
-        } else {
-            if (NULL == (typeName = json_getValue(pairs))) {
-                errRet = JSON_NOPAIRNAME;
-                return errRet;
-            }
-            if (NULL == (obTest = json_getSibling(pairs))) {
-                errRet = JSON_NO_PAIRS_SIB;
-                return errRet;
+    frame = &frames[0];
+    frame->type = type;
+    frame->vals = nextVal;
+    frame->nextVal = nextVal;
+    frame->inOrder = 1;
+    frame->indexState = VALUE_INDEX_NONE;
+    frame->inArray = 0;
+    frame->dims = 0;
+    frame->elements = NULL;
+    frame->element = NULL;
+    frame->field = 0;
+    frame->hash = msgCtx;
+
+    while (1) {
+        frame = &frames[depth];
+        if (!frame->inArray && frame->field < frame->type->numFields) {
+            field = &plan->fields[frame->type->firstField + frame->field];
+            if (SUCCESS != field->status) {
+                return field->status;
             }
-            if (NULL == (typeType = json_getValue(obTest))) {
-                errRet = JSON_TYPE_T_NOVAL;
+            typeName = &plan->strings[field->name];
+
+            if (0 == (walkVals = findValue(frame, plan, field))) {
+                errRet = JSON_TYPE_WNOVAL;
                 return errRet;
             }
-            walkVals = nextVal;
-            while (0 != walkVals) {
-                if (0 == strcmp(json_getName(walkVals), typeName)) {
-                    valStr = json_getValue(walkVals);
-                    break;
-                } else {
-                    // keep looking for val
-                    walkVals = json_getSibling(walkVals);
-                }
-            }
-
             if (JSON_TEXT == json_getType(walkVals) || JSON_INTEGER == json_getType(walkVals)) {
                 hasValue = 1;
             } else {
                 hasValue = 0;
             }
-            confirmName(typeName, hasValue);
+            confirmName(ctx, typeName, hasValue);
 
-            if (walkVals == 0) {
-                errRet = JSON_TYPE_WNOVAL;
-                return errRet;
-            } else {
-                if (0 == strncmp("address", typeType, strlen("address")-1)) {
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        // array of addresses
-                        json_t const *addrVals = json_getChild(walkVals);
-                        sha3_256_Init(&valCtx);     // hash of concatenated encoded strings
-                        while (0 != addrVals) {
-                            // just walk the string values assuming, for fixed sizes, all values are there.
-                            if (ds_vals) {
-                                marshallDsVals(json_getValue(addrVals));
-                            } else {
-                                confirmValue(json_getValue(addrVals));
-                            }
-
-                            errRet = encAddress(json_getValue(addrVals), encBytes);
-                            if (SUCCESS != errRet) {
-                                return errRet;
-                            }
-                            sha3_Update(&valCtx, (const unsigned char *)encBytes, 32);
-                            addrVals = json_getSibling(addrVals);
-                        }
-                        keccak_Final(&valCtx, encBytes);
-                    } else {
-                        if (ds_vals) {
-                            marshallDsVals(valStr);
-                        } else {
-                            confirmValue(valStr);
-                        }
-                        errRet = encAddress(valStr, encBytes);
-                        if (SUCCESS != errRet) {
-                            return errRet;
-                        }
+            if (field->kind == UDEF_TYPE) {
+                // typehash was computed when the plan was compiled
+                child = &plan->types[field->child];
+                if (SUCCESS != child->status) {
+                    return child->status;
+                }
+            }
+            if (field->arrayDims == 0) {
+                if (field->kind == UDEF_TYPE) {
+                    // findValue() needs named values
+                    if (JSON_OBJ != json_getType(walkVals)) {
+                        return STRUCT_VALUE_ERROR;
                     }
-
-                } else if (0 == strncmp("string", typeType, strlen("string")-1)) {
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        // array of strings
-                        json_t const *stringVals = json_getChild(walkVals);
-                        uint8_t strEncBytes[32];
-                        sha3_256_Init(&valCtx);     // hash of concatenated encoded strings
-                        while (0 != stringVals) {
-                            // just walk the string values assuming, for fixed sizes, all values are there.
-                            if (ds_vals) {
-                                marshallDsVals(json_getValue(stringVals));
-                            } else {
-                                confirmValue(json_getValue(stringVals));
-                            }
-                            errRet = encString(json_getValue(stringVals), strEncBytes);
-                            if (SUCCESS != errRet) {
-                                return errRet;
-                            }
-                            sha3_Update(&valCtx, (const unsigned char *)strEncBytes, 32);
-                            stringVals = json_getSibling(stringVals);
-                        }
-                        keccak_Final(&valCtx, encBytes);
-                    } else {
-                        if (ds_vals) {
-                            marshallDsVals(valStr);
-                        } else {
-                            confirmValue(valStr);
-                        }
-                        errRet = encString(valStr, encBytes);
-                        if (SUCCESS != errRet) {
-                            return errRet;
-                        }
+                    if (SUCCESS != (errRet = pushStruct(frames, maxFrames, &depth, child, json_getChild(walkVals)))) {
+                        return errRet;
                     }
+                    continue;
+                }
+                if (SUCCESS != (errRet = encodeField(ctx, field, json_getValue(walkVals), frame->type->isDomain, encBytes))) {
+                    return errRet;
+                }
+                // hash encoded bytes to final context
+                sha3_Update(frame->hash, (const unsigned char *)encBytes, 32);
+                frame->field++;
+                continue;
+            }
 
-                } else if ((0 == strncmp("uint", typeType, strlen("uint")-1)) ||
-                           (0 == strncmp("int", typeType, strlen("int")-1))) {
-
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        return INT_ARRAY_ERROR;
-                    } else {
-                        if (ds_vals) {
-                            marshallDsVals(valStr);
-                        } else {
-                            confirmValue(valStr);
-                        }
-                        uint8_t negInt = 0;     // 0 is positive, 1 is negative
-                        if (0 == strncmp("int", typeType, strlen("int")-1)) {
-                            if (*valStr == '-') {
-                                negInt = 1;
-                            }
-                        }
-                        // parse out the length val
-                        for (ctr=0; ctr<32; ctr++) {
-                            if (negInt) {
-                                // sign extend negative values
-                                encBytes[ctr] = 0xFF;
-                            } else {
-                                // zero padding for positive
-                                encBytes[ctr] = 0;
-                            }
-                        }
-                        // all int strings are assumed to be base 10 and fit into 64 bits
-                        long long intVal = strtoll(valStr, NULL, 10);
-                        // Needs to be big endian, so add to encBytes appropriately
-                        encBytes[24] = (intVal >> 56) & 0xff;
-                        encBytes[25] = (intVal >> 48) & 0xff;
-                        encBytes[26] = (intVal >> 40) & 0xff;
-                        encBytes[27] = (intVal >> 32) & 0xff;
-                        encBytes[28] = (intVal >> 24) & 0xff;
-                        encBytes[29] = (intVal >> 16) & 0xff;
-                        encBytes[30] = (intVal >> 8) & 0xff;
-                        encBytes[31] = (intVal) & 0xff;
-                   }
-
-                } else if (0 == strncmp("bytes", typeType, strlen("bytes"))) {
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        return BYTESN_ARRAY_ERROR;
-                    } else {
-                        // This could be 'bytes', 'bytes1', ..., 'bytes32'
-                        if (ds_vals) {
-                            marshallDsVals(valStr);
-                        } else {
-                            confirmValue(valStr);
-                        }
-                        if (0 == strcmp(typeType, "bytes")) {
-                           errRet = encodeBytes(valStr, encBytes);
-                        if (SUCCESS != errRet) {
-                            return errRet;
-                        }
-
-                        } else {
-                            errRet = encodeBytesN(typeType, valStr, encBytes);
-                            if (SUCCESS != errRet) {
-                                return errRet;
-                            }
-                        }
+            if (JSON_ARRAY != json_getType(walkVals)) {
+                return ARRAY_VALUE_ERROR;
+            }
+            arrayHashInit(&frame->arrHash);
+            frame->element = json_getChild(walkVals);
+            frame->inArray = 1;
+#ifdef EIP712_HOST
+            if (field->kind == UDEF_TYPE && field->arrayDims == 1 && 0 != frame->element &&
+                NULL != ctx->parallelFor && ctx->skipConfirm && ctx->parallelThreshold > 0) {
+                unsigned elements = 0;
+                const json_t *countVals;
+                for (countVals = frame->element; 0 != countVals && elements < ctx->parallelThreshold;
+                     countVals = json_getSibling(countVals)) {
+                    elements++;
+                }
+                if (elements == ctx->parallelThreshold) {
+                    if (SUCCESS != (errRet = parallelElements(ctx, maxFrames - depth - 1, plan, child,
+                                                              frame->element, &frame->arrHash))) {
+                        return errRet;
                     }
+                    frame->element = 0;     // all elements hashed
+                }
+            }
+#endif
+        }
 
-                } else if (0 == strncmp("bool", typeType, strlen(typeType))) {
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        return BOOL_ARRAY_ERROR;
-                    } else {
-                        if (ds_vals) {
-                            marshallDsVals(valStr);
-                        } else {
-                            confirmValue(valStr);
-                        }
-                        for (ctr=0; ctr<32; ctr++) {
-                            // leading zeros in bool
-                            encBytes[ctr] = 0;
-                        }
-                        if (0 == strncmp(valStr, "true", sizeof("true"))) {
-                            encBytes[31] = 0x01;
-                        }
+        if (frame->inArray) {
+            // walk the array, for fixed sizes assuming all values are there
+            if (frame->dims > 0) {
+                field = frame->elements;
+                dims = frame->dims;
+            } else {
+                field = &plan->fields[frame->type->firstField + frame->field];
+                dims = field->arrayDims;
+            }
+            if (dims == 1 && field->kind != UDEF_TYPE) {
+                for (; 0 != frame->element; frame->element = json_getSibling(frame->element)) {
+                    if (JSON_OBJ == json_getType(frame->element) || JSON_ARRAY == json_getType(frame->element)) {
+                        return ARRAY_VALUE_ERROR;
                     }
- 
-                } else {
-                    // encode user defined type
-                    char encSubTypeStr[STRBUFSIZE+1] = {0};
-                    // clear out the user-defined types list
-                    for(ctr=0; ctr<MAX_USERDEF_TYPES; ctr++) {
-                        udefList[ctr] = NULL;
-                    }  
-                                            
-                    char typeNoArrTok[MAX_TYPESTRING] = {0};
-                    // need to get typehash of type first
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        // array of structs. To parse name, remove array tokens.
-                        strncpy(typeNoArrTok, typeType, sizeof(typeNoArrTok)-1);
-                        if (strlen(typeNoArrTok) < strlen(typeType)) {
-                            return UDEF_ARRAY_NAME_ERR;
-                        }
-                        strtok(typeNoArrTok, "[");
-                        if (SUCCESS != (errRet = memcheck())) {
-                            return errRet;
-                        }
-                        if (SUCCESS != (errRet = parseType(eip712Types, typeNoArrTok, encSubTypeStr))) {
-                            return errRet;
-                        }
-                    } else {
-                        if (SUCCESS != (errRet = memcheck())) {
-                            return errRet;
-                        }
-                        if (SUCCESS != (errRet = parseType(eip712Types, typeType, encSubTypeStr))) {
-                            return errRet;
-                        }
+                    if (SUCCESS != (errRet = encodeField(ctx, field, json_getValue(frame->element),
+                                                         0 == frame->dims && frame->type->isDomain, encBytes))) {
+                        return errRet;
                     }
-                    sha3_256_Init(&valCtx);
-                    sha3_Update(&valCtx, (const unsigned char *)encSubTypeStr, (size_t)strlen(encSubTypeStr));
-                    keccak_Final(&valCtx, encBytes);
- 
-                    if (']' == typeType[strlen(typeType)-1]) {
-                        // array of udefs
-                        struct SHA3_CTX eleCtx = {0};   // local hash context
-                        struct SHA3_CTX arrCtx = {0};   // array elements hash context
-                        uint8_t eleHashBytes[32];
-
-                        sha3_256_Init(&arrCtx);
-
-                        json_t const *udefVals = json_getChild(walkVals);
-                        while (0 != udefVals) {
-                            sha3_256_Init(&eleCtx);
-                            sha3_Update(&eleCtx, (const unsigned char *)encBytes, 32);
-                            if (SUCCESS != (errRet = memcheck())) {
-                                return errRet;
-                            }
-                            if (SUCCESS != (errRet = 
-                                parseVals(
-                                  eip712Types,
-                                  json_getProperty(eip712Types, strtok(typeNoArrTok, "]")),
-                                  json_getChild(udefVals),                // where to get the values
-                                  &eleCtx                                 // encode hash happens in parse, this is the return
-                                  )
-                            )) {
-                                return errRet;
-                            }
-                            keccak_Final(&eleCtx, eleHashBytes);
-                            sha3_Update(&arrCtx, (const unsigned char *)eleHashBytes, 32);
-                            // just walk the udef values assuming, for fixed sizes, all values are there.
-                            udefVals = json_getSibling(udefVals);
-                        } 
-                        keccak_Final(&arrCtx, encBytes);
-
-                    } else {
-                        sha3_256_Init(&valCtx);
-                        sha3_Update(&valCtx, (const unsigned char *)encBytes, (size_t)sizeof(encBytes));
-                        if (SUCCESS != (errRet = memcheck())) {
-                            return errRet;
-                        }
-                        if (SUCCESS != (errRet = 
-                            parseVals(
-                                  eip712Types,
-                                  json_getProperty(eip712Types, typeType),
-                                  json_getChild(walkVals),                // where to get the values
-                                  &valCtx           // val hash happens in parse, this is the return
-                                  )
-                        )) {
-                            return errRet;
-                        }    
-                        keccak_Final(&valCtx, encBytes);
-                    }                         
+                    arrayHashAdd(&frame->arrHash, encBytes);
                 }
             }
+            if (0 != frame->element) {
+                if (dims > 1) {
+                    errRet = pushArray(frames, maxFrames, &depth, field, dims - 1, frame->element);
+                } else if (JSON_OBJ != json_getType(frame->element)) {
+                    errRet = ARRAY_VALUE_ERROR;
+                } else {
+                    errRet = pushStruct(frames, maxFrames, &depth, &plan->types[field->child],
+                                        json_getChild(frame->element));
+                }
+                if (SUCCESS != errRet) {
+                    return errRet;
+                }
+                continue;
+            }
+            arrayHashFinal(&frame->arrHash, encBytes);
+            if (frame->dims == 0) {
+                frame->inArray = 0;
+                sha3_Update(frame->hash, (const unsigned char *)encBytes, 32);
+                frame->field++;
+                continue;
+            }
+            // inner array complete, its hash is an element of the parent
+        } else {
+            // struct complete
+            if (frame->type->isDomain) {
+                // domain sep values are confirmed on a single screen
+                dsConfirm(ctx);
+            }
+            if (depth == 0) {
+                return SUCCESS;
+            }
+            keccak_Final(frame->hash, encBytes);
+        }
 
+        frame = &frames[--depth];
+        if (frame->inArray) {
+            arrayHashAdd(&frame->arrHash, encBytes);
+            frame->element = json_getSibling(frame->element);
+        } else {
             // hash encoded bytes to final context
-            sha3_Update(msgCtx, (const unsigned char *)encBytes, 32);
+            sha3_Update(frame->hash, (const unsigned char *)encBytes, 32);
+            frame->field++;
         }
-        tarray = json_getSibling(tarray); 
     }
-    if (ds_vals) {
-        dsConfirm();
+}
+
+/*
+    Copies a name into the plan string table.
+    Returns the offset of the copy, or PLAN_NO_STRING if the table is full.
+*/
+unsigned planString(eip712Plan *plan, const char *name) {
+    unsigned offset = plan->strLen;
+    size_t len = strlen(name) + 1;
+
+    if (len > sizeof(plan->strings) - plan->strLen) {
+        return PLAN_NO_STRING;
     }
+    memcpy(&plan->strings[offset], name, len);
+    plan->strLen += len;
+    return offset;
+}
 
+/*
+    Entry:
+            plan points to the plan being compiled, all types already named
+            typeStr is the field type string, e.g. "uint256", "bytes8", "Person[]"
+            field points to the plan field to fill in
+    Exit:
+            field kind, size, sign, array dimension and child type are resolved
+            returns error list status for the field
+*/
+int resolveField(const eip712Plan *plan, const char *typeStr, planField *field) {
+    char baseType[MAX_TYPESTRING] = {0};
+    const char *arrTok;
+    size_t baseLen;
+    unsigned ctr, bits;
+
+    field->size = 0;
+    field->isSigned = 0;
+    field->arrayDims = 0;
+    field->child = PLAN_NO_TYPE;
+
+    // split off the array tokens, "uint8[2][]" is a two dimensional array of uint8
+    if (NULL != (arrTok = strchr(typeStr, '['))) {
+        baseLen = arrTok - typeStr;
+        for (; *arrTok != '\0'; arrTok++) {
+            if (*arrTok == '[') {
+                field->arrayDims++;
+            }
+        }
+    } else {
+        baseLen = strlen(typeStr);
+    }
+    if (baseLen >= sizeof(baseType) || (field->arrayDims > 0 && strlen(typeStr) >= MAX_TYPESTRING)) {
+        field->kind = UDEF_TYPE;
+        return UDEF_ARRAY_NAME_ERR;
+    }
+    memcpy(baseType, typeStr, baseLen);
+
+    if (0 == strcmp(baseType, "address")) {
+        field->kind = ADDRESS;
+    } else if (0 == strcmp(baseType, "string")) {
+        field->kind = STRING;
+    } else if (0 == strcmp(baseType, "bool")) {
+        field->kind = BOOL;
+    } else if (0 == strcmp(baseType, "bytes")) {
+        field->kind = BYTES;
+    } else if (0 == strncmp(baseType, "bytes", sizeof("bytes")-1)) {
+        // 'bytes1', ..., 'bytes32'
+        field->kind = BYTES_N;
+        field->size = (uint8_t)(strtol(&baseType[sizeof("bytes")-1], NULL, 10));
+        if (field->size > 32) {
+            return BYTESN_SIZE_ERROR;
+        }
+    } else if (0 == strncmp(baseType, "int", sizeof("int")-1) ||
+               0 == strncmp(baseType, "uint", sizeof("uint")-1)) {
+        // 'int8', 'int16', ..., 'int256', plain 'int' is 'int256'. Same for uint.
+        field->isSigned = (baseType[0] == 'i');
+        field->kind = field->isSigned ? INT : UINT;
+        bits = (unsigned)strtol(&baseType[field->isSigned ? 3 : 4], NULL, 10);
+        field->size = (bits == 0) ? 32 : (uint8_t)(bits / 8);
+        if (bits % 8 != 0 || bits > 256) {
+            return TYPE_NOT_ENCODABLE;
+        }
+    } else {
+        // user defined type, must be one of the plan types
+        field->kind = UDEF_TYPE;
+        for (ctr=0; ctr<plan->numTypes; ctr++) {
+            if (0 == strcmp(&plan->strings[plan->types[ctr].name], baseType)) {
+                field->child = ctr;
+                return SUCCESS;
+            }
+        }
+        return JSON_TYPE_S_ERR;
+    }
     return SUCCESS;
 }
 
-int encode(const json_t *jsonTypes, const json_t *jsonVals, const char *typeS, uint8_t *hashRet) {
-    int ctr;
-    char encTypeStr[STRBUFSIZE+1] = {0};
-    uint8_t typeHash[32];
+/*
+    Entry:
+            ctx points to the encoder context
+            jsonTypes points to the json containing the "types" property
+            plan points to caller allocated plan
+    Exit:
+            plan holds every type of "types" with resolved fields and its typehash
+            returns error list status
+
+    Problems with a single type or field are kept in its status and reported when a value
+    of that type is encoded, so unused types do not fail the whole schema.
+*/
+int eip712_compile_plan(eip712_ctx *ctx, const json_t *jsonTypes, eip712Plan *plan) {
+    json_t const *typesProp, *jType, *tarray, *pairs, *obTest;
+    const char *typeName, *typeType;
+    planType *type;
+    planField *field, *other;
+    unsigned offset;
+    int errRet;
+
+    memzero(plan, sizeof(eip712Plan));
+    if (NULL == (typesProp = json_getProperty(jsonTypes, "types"))) {
+        return JSON_TYPESPROPERR;
+    }
+
+    // name all types first so fields can refer to types defined after them
+    for (jType = json_getChild(typesProp); jType != 0; jType = json_getSibling(jType)) {
+        if (plan->numTypes == MAX_PLAN_TYPES) {
+            return UDEFS_OVERFLOW;
+        }
+        if (NULL == json_getName(jType)) {
+            return JSON_TYPE_S_NAMEERR;
+        }
+        type = &plan->types[plan->numTypes++];
+        if (PLAN_NO_STRING == (offset = planString(plan, json_getName(jType)))) {
+            return PLAN_SIZE_ERROR;
+        }
+        type->name = offset;
+        type->isDomain = (0 == strcmp(json_getName(jType), "EIP712Domain"));
+    }
+
+    type = plan->types;
+    for (jType = json_getChild(typesProp); jType != 0; jType = json_getSibling(jType), type++) {
+        type->firstField = plan->numFields;
+        type->uniqueNames = 1;
+        for (tarray = json_getChild(jType); tarray != 0; tarray = json_getSibling(tarray)) {
+            if (plan->numFields == MAX_PLAN_FIELDS) {
+                return PLAN_SIZE_ERROR;
+            }
+            field = &plan->fields[plan->numFields++];
+            type->numFields++;
+            field->name = 0;
+            field->kind = NOT_ENCODABLE;
+            field->child = PLAN_NO_TYPE;
+
+            if (NULL == (pairs = json_getChild(tarray))) {
+                field->status = JSON_NO_PAIRS;
+            } else if (pairs->type != JSON_TEXT) {
+                field->status = JSON_PAIRS_NOTEXT;
+            } else if (NULL == (typeName = json_getValue(pairs))) {
+                field->status = JSON_NOPAIRNAME;
+            } else if (NULL == (obTest = json_getSibling(pairs))) {
+                field->status = JSON_NO_PAIRS_SIB;
+            } else if (NULL == (typeType = json_getValue(obTest))) {
+                field->status = JSON_TYPE_T_NOVAL;
+            } else {
+                if (PLAN_NO_STRING == (offset = planString(plan, typeName))) {
+                    return PLAN_SIZE_ERROR;
+                }
+                field->name = offset;
+                field->nameHash = nameHash(typeName);
+                field->status = resolveField(plan, typeType, field);
+                for (other = &plan->fields[type->firstField]; other < field; other++) {
+                    if (other->nameHash == field->nameHash && 0 == strcmp(&plan->strings[other->name], typeName)) {
+                        type->uniqueNames = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // typehashes use the hashable type string of parseType(), once per type
+    for (offset=0; offset<plan->numTypes; offset++) {
+        type = &plan->types[offset];
+        errRet = getTypeHash(ctx, plan, typesProp, type, type->typeHash);
+        type->status = errRet;
+    }
+
+    return SUCCESS;
+}
+
+// Returns the plan type named name, or NULL
+const planType *findPlanType(const eip712Plan *plan, const char *name) {
+    unsigned ctr;
+
+    for (ctr=0; ctr<plan->numTypes; ctr++) {
+        if (0 == strcmp(&plan->strings[plan->types[ctr].name], name)) {
+            return &plan->types[ctr];
+        }
+    }
+    return NULL;
+}
+
+/*
+    Entry:
+            ctx points to the encoder context
+            plan points to types compiled by compile_plan()
+            jsonVals points to the json containing the "domain" and "message" properties
+            typeS is the type to encode, "EIP712Domain" encodes the domain
+            hashRet points to caller allocated 32 byte buffer
+    Exit:
+            hashRet holds the hashStruct of the domain or message
+            returns error list status
+*/
+int eip712_encode_with_plan(eip712_ctx *ctx, const eip712Plan *plan, const json_t *jsonVals, const char *typeS, uint8_t *hashRet) {
     struct SHA3_CTX finalCtx = {0};
     int errRet;
-    json_t const *typesProp;
-    json_t const *typeSprop;
     json_t const *domainOrMessageProp;
     json_t const *valsProp;
+    const planType *type = NULL;
     char *domOrMsgStr = NULL;
 
-    // clear out the user-defined types list
-    for(ctr=0; ctr<MAX_USERDEF_TYPES; ctr++) {
-        udefList[ctr] = NULL;
-    }  
-    if (NULL == (typesProp = json_getProperty(jsonTypes, "types"))) {
-        errRet = JSON_TYPESPROPERR;
+    if (NULL == (type = findPlanType(plan, typeS))) {                                   // e.g., typeS = "EIP712Domain"
+        errRet = JSON_TYPE_S_ERR;
         return errRet;
     }
-    if (SUCCESS != (errRet = 
-        parseType(typesProp, typeS, encTypeStr)
-    )) {
-        return errRet;
-    }     
-
-    sha3_256_Init(&finalCtx);
-    sha3_Update(&finalCtx, (const unsigned char *)encTypeStr, (size_t)strlen(encTypeStr));
-    keccak_Final(&finalCtx, typeHash);
+    if (SUCCESS != type->status) {
+        return type->status;
+    }
 
     // They typehash must be the first message of the final hash, this is the start 
     sha3_256_Init(&finalCtx);
-    sha3_Update(&finalCtx, (const unsigned char *)typeHash, (size_t)sizeof(typeHash));
-    
-    if (NULL == (typeSprop = json_getProperty(typesProp, typeS))) {                   // e.g., typeS = "EIP712Domain"
-        errRet = JSON_TYPESPROPERR;
-        return errRet;
-    }
+    sha3_Update(&finalCtx, (const unsigned char *)type->typeHash, (size_t)sizeof(type->typeHash));
 
-    if (0 == strncmp(typeS, "EIP712Domain", sizeof("EIP712Domain"))) {
-        confirmProp = DOMAIN;
+    if (type->isDomain) {
+        ctx->confirmProp = DOMAIN;
         domOrMsgStr = "domain";
     } else {
         // This is the message value encoding
-        confirmProp = MESSAGE;
+        ctx->confirmProp = MESSAGE;
         domOrMsgStr = "message";
     }
-    if (NULL == (domainOrMessageProp = json_getProperty(jsonVals, domOrMsgStr))) {      // "message" or "domain" property
-        if (confirmProp == DOMAIN) {
+    if (NULL == (domainOrMessageProp = json_getProperty(jsonVals, domOrMsgStr)) ||      // "message" or "domain" property
+        JSON_OBJ != json_getType(domainOrMessageProp)) {
+        if (ctx->confirmProp == DOMAIN) {
             errRet = JSON_DPROPERR;
         } else {
             errRet = JSON_MPROPERR;
@@ -782,19 +1385,247 @@ int encode(const json_t *jsonTypes, const json_t *jsonVals, const char *typeS, u
         return errRet;
     } 
     if (NULL == (valsProp = json_getChild(domainOrMessageProp))) {                    // "message" or "domain" property values
-        if (confirmProp == MESSAGE) {
+        if (ctx->confirmProp == MESSAGE) {
             errRet = NULL_MSG_HASH;         // this is legal, not an error.
             return errRet;
         }
     } 
 
-    if (SUCCESS != (errRet = parseVals(typesProp, typeSprop, valsProp, &finalCtx))) {
+    if (SUCCESS != (errRet = parseVals(ctx, ctx->frames, MAX_ENCODE_DEPTH, plan, type, valsProp, &finalCtx))) {
             return errRet;
     }
 
     keccak_Final(&finalCtx, hashRet);
-    // clear typeStr
-    memzero(encTypeStr, sizeof(encTypeStr));
 
     return SUCCESS;
 }
+
+#ifdef EIP712_HOST
+/*
+    Entry:
+            jsonTypes points to the json containing the "types" property
+            jsonVals points to the json containing the "domain" property
+            key points to caller allocated 32 byte buffer
+    Exit:
+            key holds keccak of type, name and value text of every EIP712Domain field in
+            type order, the only inputs of the domain separator
+            returns 0 if the domain is not cached: it is missing, not an object, incomplete,
+            or has struct or array fields
+*/
+int dsCacheKey(const json_t *jsonTypes, const json_t *jsonVals, uint8_t *key) {
+    struct SHA3_CTX keyCtx;
+    json_t const *domainType, *domainVals, *tarray, *pairs, *walkVals;
+    const char *name, *typeType, *value;
+
+    if (NULL == (domainType = json_getProperty(json_getProperty(jsonTypes, "types"), "EIP712Domain")) ||
+        NULL == (domainVals = json_getProperty(jsonVals, "domain")) || JSON_OBJ != json_getType(domainVals)) {
+        // encoding reports the error
+        return 0;
+    }
+    sha3_256_Init(&keyCtx);
+    for (tarray = json_getChild(domainType); tarray != 0; tarray = json_getSibling(tarray)) {
+        if (NULL == (pairs = json_getChild(tarray)) || NULL == (name = json_getValue(pairs)) ||
+            NULL == json_getSibling(pairs) || NULL == (typeType = json_getValue(json_getSibling(pairs))) ||
+            NULL != strchr(typeType, '[')) {
+            return 0;
+        }
+        for (walkVals = json_getChild(domainVals); 0 != walkVals; walkVals = json_getSibling(walkVals)) {
+            if (0 == strcmp(json_getName(walkVals), name)) {
+                break;
+            }
+        }
+        if (0 == walkVals || JSON_OBJ == json_getType(walkVals) || JSON_ARRAY == json_getType(walkVals) ||
+            NULL == (value = json_getValue(walkVals))) {
+            return 0;
+        }
+        // nul terminators keep the strings apart
+        sha3_Update(&keyCtx, (const unsigned char *)typeType, strlen(typeType)+1);
+        sha3_Update(&keyCtx, (const unsigned char *)name, strlen(name)+1);
+        sha3_Update(&keyCtx, (const unsigned char *)value, strlen(value)+1);
+    }
+    keccak_Final(&keyCtx, key);
+    return 1;
+}
+
+// Copies the cached domain separator of key to hashRet, returns 0 if it is not cached
+int dsCacheFind(eip712_ctx *ctx, const uint8_t *key, uint8_t *hashRet) {
+    unsigned ctr;
+
+    for (ctr=0; ctr<DS_CACHE_SIZE; ctr++) {
+        if (0 != ctx->dsCache[ctr].lastUse && 0 == memcmp(ctx->dsCache[ctr].key, key, 32)) {
+            ctx->dsCache[ctr].lastUse = ++ctx->dsCacheClock;
+            memcpy(hashRet, ctx->dsCache[ctr].domainSeparator, 32);
+            ctx->dsCacheHits++;
+            return 1;
+        }
+    }
+    ctx->dsCacheMisses++;
+    return 0;
+}
+
+// Keeps a domain separator, in an unused or the least recently used entry
+void dsCacheStore(eip712_ctx *ctx, const uint8_t *key, const uint8_t *domainSeparator) {
+    dsCacheEntry *entry = &ctx->dsCache[0];
+    unsigned ctr;
+
+    for (ctr=1; ctr<DS_CACHE_SIZE; ctr++) {
+        if (ctx->dsCache[ctr].lastUse < entry->lastUse) {
+            entry = &ctx->dsCache[ctr];
+        }
+    }
+    memcpy(entry->key, key, 32);
+    memcpy(entry->domainSeparator, domainSeparator, 32);
+    entry->lastUse = ++ctx->dsCacheClock;
+}
+#endif
+
+// Absorbs the length of string as 4 bytes, then the string
+void absorbCounted(struct SHA3_CTX *hashCtx, const char *string) {
+    size_t len = strlen(string);
+    uint8_t count[4];
+
+    count[0] = (uint8_t)(len >> 24);
+    count[1] = (uint8_t)(len >> 16);
+    count[2] = (uint8_t)(len >> 8);
+    count[3] = (uint8_t)len;
+    sha3_Update(hashCtx, count, sizeof(count));
+    sha3_Update(hashCtx, (const unsigned char *)string, len);
+}
+
+/*
+    Entry:
+            jsonTypes points to the json containing the "types" property
+            id points to caller allocated 32 byte buffer
+    Exit:
+            id holds the keccak of the canonical "types" json
+            returns SUCCESS, JSON_TYPESPROPERR if there is no "types" property, or
+            RECURSION_ERROR if it nests deeper than SCHEMA_ID_DEPTH
+
+    The canonical form is, for every value in document order, its json type as a byte, then
+    its name and text with length prefixes. Containers end with a byte no type has. Two
+    "types" objects that differ only in formatting get the same id, and since tiny-json has
+    already unescaped names and text, the lengths keep a quote or comma in a name from reading
+    like the next field. The walk keeps its parents on an explicit stack.
+*/
+int eip712_schema_id(const json_t *jsonTypes, uint8_t *id) {
+    struct SHA3_CTX idCtx;
+    const json_t *parents[SCHEMA_ID_DEPTH];
+    const json_t *json;
+    unsigned depth = 0;
+    uint8_t tag;
+
+    if (NULL == (json = json_getProperty(jsonTypes, "types"))) {
+        return JSON_TYPESPROPERR;
+    }
+    sha3_256_Init(&idCtx);
+    while (1) {
+        tag = (uint8_t)json_getType(json);
+        sha3_Update(&idCtx, &tag, 1);
+        if (NULL != json_getName(json)) {
+            absorbCounted(&idCtx, json_getName(json));
+        }
+        if (JSON_OBJ == json_getType(json) || JSON_ARRAY == json_getType(json)) {
+            if (NULL != json_getChild(json)) {
+                if (depth == SCHEMA_ID_DEPTH) {
+                    return RECURSION_ERROR;
+                }
+                parents[depth++] = json;
+                json = json_getChild(json);
+                continue;
+            }
+            tag = 0xFF;
+            sha3_Update(&idCtx, &tag, 1);
+        } else {
+            absorbCounted(&idCtx, json_getValue(json));
+        }
+        // last value of its containers, close them
+        while (depth > 0 && NULL == json_getSibling(json)) {
+            json = parents[--depth];
+            tag = 0xFF;
+            sha3_Update(&idCtx, &tag, 1);
+        }
+        if (depth == 0) {
+            break;
+        }
+        json = json_getSibling(json);
+    }
+    keccak_Final(&idCtx, id);
+    return SUCCESS;
+}
+
+int eip712_encode(eip712_ctx *ctx, const json_t *jsonTypes, const json_t *jsonVals, const char *typeS, uint8_t *hashRet) {
+    uint8_t typesId[32];
+    int errRet;
+#ifdef EIP712_HOST
+    uint8_t dsKey[32];
+    int cached = 0;
+    const planType *domainType;
+#endif
+
+    if (SUCCESS != (errRet = eip712_schema_id(jsonTypes, typesId))) {
+        return errRet;
+    }
+    if (!ctx->planReady || 0 != memcmp(ctx->planId, typesId, sizeof(typesId))) {
+        // compile once per schema, domain and message encoding and later documents with
+        // the same types share the plan. Keyed on content, a types object parsed into the
+        // json memory of a previous one cannot pick up its plan.
+        ctx->planReady = 0;
+        if (SUCCESS != (errRet = eip712_compile_plan(ctx, jsonTypes, &ctx->plan))) {
+            return errRet;
+        }
+        memcpy(ctx->planId, typesId, sizeof(typesId));
+        ctx->planReady = 1;
+    }
+#ifdef EIP712_HOST
+    if (ctx->skipConfirm && 0 == strcmp(typeS, "EIP712Domain")) {
+        // a known domain skips encoding the values, but only once the types are known to
+        // compile, so a hit cannot hide an error the encode would have returned
+        domainType = findPlanType(&ctx->plan, typeS);
+        if (NULL != domainType && SUCCESS == domainType->status &&
+            (cached = dsCacheKey(jsonTypes, jsonVals, dsKey)) && dsCacheFind(ctx, dsKey, hashRet)) {
+            return SUCCESS;
+        }
+    }
+#endif
+
+    errRet = eip712_encode_with_plan(ctx, &ctx->plan, jsonVals, typeS, hashRet);
+#ifdef EIP712_HOST
+    if (cached && SUCCESS == errRet) {
+        dsCacheStore(ctx, dsKey, hashRet);
+    }
+#endif
+    return errRet;
+}
+
+/*
+    Entry:
+            domainSeparator points to the 32 byte domain separator
+            msgHash points to the 32 byte message hash, NULL if primaryType is EIP712Domain
+            digest points to caller allocated 32 byte buffer
+    Exit:
+            digest holds keccak(0x19 0x01 || domainSeparator || msgHash), the hash that is signed
+*/
+void eip712_digest(const uint8_t *domainSeparator, const uint8_t *msgHash, uint8_t *digest) {
+    uint8_t preimage[2+32+32];
+
+    preimage[0] = 0x19;
+    preimage[1] = 0x01;
+    memcpy(&preimage[2], domainSeparator, 32);
+    if (NULL != msgHash) {
+        memcpy(&preimage[2+32], msgHash, 32);
+    }
+    // fits one keccak block, a single permutation
+    keccak256_block(preimage, NULL != msgHash ? sizeof(preimage) : 2+32, digest);
+}
+
+int encode(const json_t *jsonTypes, const json_t *jsonVals, const char *typeS, uint8_t *hashRet) {
+    return eip712_encode(&defaultCtx, jsonTypes, jsonVals, typeS, hashRet);
+}
+
+int compile_plan(const json_t *jsonTypes, eip712Plan *plan) {
+    return eip712_compile_plan(&defaultCtx, jsonTypes, plan);
+}
+
+int encode_with_plan(const eip712Plan *plan, const json_t *jsonVals, const char *typeS, uint8_t *hashRet) {
+    return eip712_encode_with_plan(&defaultCtx, plan, jsonVals, typeS, hashRet);
+}
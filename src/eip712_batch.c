@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "./eip712_batch.h"
+#include "./thread_pool.h"
+#include "keepkey/firmware/eip712.h"
+#include "keepkey/firmware/tiny-json.h"
+
+struct batchWorker {
+    eip712_ctx ctx;
+    json_t *pool;
+    size_t poolSize;
+    char *text;                     // copy of the document, tiny-json parses in place
+    size_t textSize;
+};
+
+typedef struct {
+    const char *const *docs;
+    eip712Result *results;
+    batchWorker *workers;
+} batchRun;
+
+size_t jsonPoolSize(const char *text) {
+    size_t count = 1;
+    int inString = 0;
+
+    // every value but the first opens a container or follows a comma
+    for (; '\0' != *text; text++) {
+        if (inString) {
+            if ('\\' == *text && '\0' != text[1]) {
+                text++;
+            } else if ('"' == *text) {
+                inString = 0;
+            }
+        } else if ('"' == *text) {
+            inString = 1;
+        } else if (',' == *text || '[' == *text || '{' == *text) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int hexNibbleValue(char chr) {
+    if (chr >= '0' && chr <= '9') {
+        return chr - '0';
+    }
+    if (chr >= 'a' && chr <= 'f') {
+        return chr - 'a' + 10;
+    }
+    if (chr >= 'A' && chr <= 'F') {
+        return chr - 'A' + 10;
+    }
+    return -1;
+}
+
+/*
+    Compares a hash with the expected one, name in the "results" block: "0x" and 64 hex
+    digits, or null for no message hash. The caller checks that name is there.
+*/
+static int hashMatches(const json_t *expected, const char *name, int status, const uint8_t *hash) {
+    const json_t *prop;
+    const char *hex;
+    int ctr, hi, lo;
+
+    prop = json_getProperty(expected, name);
+    if (JSON_NULL == json_getType(prop)) {
+        return NULL_MSG_HASH == status;
+    }
+    if (SUCCESS != status || JSON_TEXT != json_getType(prop) || NULL == (hex = json_getValue(prop))) {
+        return 0;
+    }
+    if ('0' == hex[0] && ('x' == hex[1] || 'X' == hex[1])) {
+        hex += 2;
+    }
+    if (64 != strlen(hex)) {
+        return 0;
+    }
+    for (ctr=0; ctr<32; ctr++) {
+        hi = hexNibbleValue(hex[2*ctr]);
+        lo = hexNibbleValue(hex[2*ctr+1]);
+        if (0 > hi || 0 > lo || hash[ctr] != (uint8_t)(hi << 4 | lo)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void eip712_encode_doc(batchWorker *worker, char *text, eip712Result *result) {
+    const json_t *root, *expected;
+    const char *primaryType;
+    size_t poolSize;
+    unsigned hits, misses;
+    json_t *pool;
+
+    memset(result, 0, sizeof(eip712Result));
+    if ((poolSize = jsonPoolSize(text)) > worker->poolSize) {
+        if (NULL == (pool = realloc(worker->pool, poolSize * sizeof(json_t)))) {
+            result->dsStatus = result->msgStatus = result->digestStatus = GENERAL_ERROR;
+            return;
+        }
+        worker->pool = pool;
+        worker->poolSize = poolSize;
+    }
+
+    if (NULL == (root = json_create(text, worker->pool, (unsigned)worker->poolSize))) {
+        result->dsStatus = result->msgStatus = result->digestStatus = JSON_CREATE_ERR;
+        return;
+    }
+    // the plan is keyed on the types content, it is kept while documents share a schema
+    // the domain separator cache is keyed on content and outlives the document
+    hits = worker->ctx.dsCacheHits;
+    misses = worker->ctx.dsCacheMisses;
+    result->dsStatus = eip712_encode(&worker->ctx, root, root, "EIP712Domain", result->domainSeparator);
+    result->dsCacheHit = (uint8_t)(worker->ctx.dsCacheHits - hits);
+    result->dsCacheMiss = (uint8_t)(worker->ctx.dsCacheMisses - misses);
+    if (NULL == (primaryType = json_getPropertyValue(root, "primaryType"))) {
+        result->msgStatus = JSON_PTYPEVALERR;
+    } else if (0 == strcmp(primaryType, "EIP712Domain")) {
+        result->msgStatus = NULL_MSG_HASH;
+    } else {
+        result->msgStatus = eip712_encode(&worker->ctx, root, root, primaryType, result->msgHash);
+    }
+
+    if (SUCCESS != result->dsStatus) {
+        result->digestStatus = result->dsStatus;
+    } else if (SUCCESS != result->msgStatus && NULL_MSG_HASH != result->msgStatus) {
+        result->digestStatus = result->msgStatus;
+    } else {
+        result->digestStatus = SUCCESS;
+        eip712_digest(result->domainSeparator, SUCCESS == result->msgStatus ? result->msgHash : NULL,
+                      result->digest);
+    }
+
+    // a block without both hashes has nothing to verify against
+    if (NULL != (expected = json_getProperty(root, "results")) &&
+        NULL != json_getProperty(expected, "domain_separator_hash") &&
+        NULL != json_getProperty(expected, "message_hash")) {
+        result->verify = hashMatches(expected, "domain_separator_hash", result->dsStatus, result->domainSeparator) &&
+                         hashMatches(expected, "message_hash", result->msgStatus, result->msgHash) ?
+                         VERIFY_PASS : VERIFY_FAIL;
+    }
+}
+
+static void encodeDoc(void *arg, unsigned workerId, size_t idx) {
+    batchRun *run = (batchRun *)arg;
+    batchWorker *worker = &run->workers[workerId];
+    size_t len = strlen(run->docs[idx]) + 1;
+    char *text;
+
+    if (len > worker->textSize) {
+        if (NULL == (text = realloc(worker->text, len))) {
+            memset(&run->results[idx], 0, sizeof(eip712Result));
+            run->results[idx].dsStatus = run->results[idx].msgStatus = GENERAL_ERROR;
+            run->results[idx].digestStatus = GENERAL_ERROR;
+            return;
+        }
+        worker->text = text;
+        worker->textSize = len;
+    }
+    memcpy(worker->text, run->docs[idx], len);
+    eip712_encode_doc(worker, worker->text, &run->results[idx]);
+}
+
+batchWorker *eip712_worker_new(void) {
+    batchWorker *worker;
+
+    if (NULL != (worker = calloc(1, sizeof(batchWorker)))) {
+        eip712_ctx_init(&worker->ctx);
+        worker->ctx.skipConfirm = 1;
+    }
+    return worker;
+}
+
+void eip712_worker_free(batchWorker *worker) {
+    if (NULL != worker) {
+        free(worker->text);
+        free(worker->pool);
+        free(worker);
+    }
+}
+
+int eip712_encode_batch(const char *const docs[], size_t numDocs, eip712Result results[], unsigned jobs,
+                        unsigned arrayThreshold) {
+    batchRun run;
+    unsigned ctr, elementJobs;
+    int errRet;
+
+    if (jobs == 0) {
+        jobs = poolCpus();
+    }
+    // documents on pool threads encode their arrays serially, see poolParallelFor()
+    elementJobs = jobs;
+    if (jobs > numDocs) {
+        jobs = numDocs ? (unsigned)numDocs : 1;
+    }
+    if (NULL == (run.workers = calloc(jobs, sizeof(batchWorker)))) {
+        return GENERAL_ERROR;
+    }
+    for (ctr=0; ctr<jobs; ctr++) {
+        eip712_ctx_init(&run.workers[ctr].ctx);
+        run.workers[ctr].ctx.skipConfirm = 1;
+        run.workers[ctr].ctx.parallelFor = poolParallelFor;
+        run.workers[ctr].ctx.parallelArg = &elementJobs;
+        run.workers[ctr].ctx.parallelThreshold = arrayThreshold;
+        run.workers[ctr].ctx.parallelWorkers = elementJobs;
+    }
+    run.docs = docs;
+    run.results = results;
+
+    errRet = poolFor(numDocs, jobs, encodeDoc, &run);
+
+    for (ctr=0; ctr<jobs; ctr++) {
+        free(run.workers[ctr].text);
+        free(run.workers[ctr].pool);
+    }
+    free(run.workers);
+    return errRet;
+}
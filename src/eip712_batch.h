@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Batch encoding of whole typed data documents ("types", "primaryType", "domain" and
+    "message" in one json object) on a thread pool, host only. Every worker has its own
+    eip712_ctx and json pool, grown to the largest document, and encodes without review
+    screens.
+*/
+
+#ifndef __EIP712_BATCH_H__
+#define __EIP712_BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BATCH_ARRAY_THRESHOLD   256     // default struct array size hashed on all jobs
+
+// result of comparing the hashes with the "results" block of a test vector document
+#define VERIFY_NONE             0       // no "results" block, or one without both hashes
+#define VERIFY_PASS             1
+#define VERIFY_FAIL             2
+
+typedef struct {
+    int dsStatus;                   // error list status of the domain separator
+    int msgStatus;                  // error list status of the message, NULL_MSG_HASH if none
+    uint8_t domainSeparator[32];
+    uint8_t msgHash[32];
+    int digestStatus;               // SUCCESS if both hashes are, else the first failing status
+    uint8_t digest[32];             // eip712_digest() of the two hashes
+    uint8_t dsCacheHit;             // 1 if the domain separator came from the worker's cache
+    uint8_t dsCacheMiss;            // 1 if it was looked up and not found, both 0 if not cacheable
+    int verify;                     // VERIFY_NONE, VERIFY_PASS or VERIFY_FAIL
+} eip712Result;
+
+/*
+    Entry:
+            text points to nul terminated json text
+    Exit:
+            returns an upper bound on the json objects json_create() needs for text
+*/
+size_t jsonPoolSize(const char *text);
+
+// Encoder for one document at a time on the calling thread, keeps its json pool and
+// domain separator cache from one document to the next
+typedef struct batchWorker batchWorker;
+
+// returns NULL if out of memory
+batchWorker *eip712_worker_new(void);
+void eip712_worker_free(batchWorker *worker);
+/*
+    Entry:
+            worker from eip712_worker_new()
+            text points to one nul terminated json document, parsed in place
+            result points to caller allocated result
+    Exit:
+            result holds the hashes of text, text is no longer valid json
+*/
+void eip712_encode_doc(batchWorker *worker, char *text, eip712Result *result);
+
+/*
+    Entry:
+            docs points to numDocs nul terminated json documents, left unchanged
+            results points to caller allocated array of numDocs results
+            jobs is the number of threads, 0 for one per cpu
+            arrayThreshold is the struct array size from which elements are encoded on all
+            jobs, 0 to always encode elements serially. Only takes effect for a single
+            document, with more documents the jobs are busy with whole documents.
+    Exit:
+            results[n] holds the hashes of docs[n]
+            returns SUCCESS, or GENERAL_ERROR if out of memory
+*/
+int eip712_encode_batch(const char *const docs[], size_t numDocs, eip712Result results[], unsigned jobs,
+                        unsigned arrayThreshold);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Compiled plan cache file for the simulator and other hosted tools. Not for firmware: uses
+    mmap and file locking.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "./plan_cache.h"
+
+/*
+    Checks every count, index and string offset of a plan read from a file against the plan
+    limits, so the encoder can use it like one it compiled. Returns 0 if any is out of range.
+*/
+static int planValid(const eip712Plan *plan) {
+    const planType *type;
+    const planField *field;
+    unsigned ctr;
+
+    if (plan->numTypes > MAX_PLAN_TYPES || plan->numFields > MAX_PLAN_FIELDS ||
+        plan->strLen > PLAN_STRBUFSIZE) {
+        return 0;
+    }
+    // every offset below strLen then ends in the table
+    if (0 != plan->strLen && '\0' != plan->strings[plan->strLen-1]) {
+        return 0;
+    }
+    for (ctr=0; ctr<plan->numTypes; ctr++) {
+        type = &plan->types[ctr];
+        if (type->name >= plan->strLen || type->firstField + type->numFields > plan->numFields ||
+            type->isDomain > 1 || type->uniqueNames > 1) {
+            return 0;
+        }
+    }
+    for (ctr=0; ctr<plan->numFields; ctr++) {
+        field = &plan->fields[ctr];
+        if (field->name >= plan->strLen || field->kind > UDEF_TYPE || field->size > 32 ||
+            (PLAN_NO_TYPE != field->child && field->child >= plan->numTypes) ||
+            (UDEF_TYPE == field->kind && SUCCESS == field->status && PLAN_NO_TYPE == field->child)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int headerValid(const planCacheHeader *hdr) {
+    return 0 == memcmp(hdr->magic, PLAN_CACHE_MAGIC, sizeof(hdr->magic)) &&
+           PLAN_CACHE_VERSION == hdr->version &&
+           sizeof(eip712Plan) == hdr->planSize;
+}
+
+/*
+    Entry:
+            cache points to cache to open
+            path is the cache file name
+    Exit:
+            cache maps the entries in the file. A missing, empty or incompatible file gives an
+            empty cache, which is not an error: plans added later are written to path.
+            returns SUCCESS, or GENERAL_ERROR if the file exists but cannot be read or
+            holds a plan that fails planValid(). The cache is empty then too.
+*/
+int planCacheOpen(planCache *cache, const char *path) {
+    const planCacheHeader *hdr;
+    struct stat st;
+    void *map;
+    const planCacheEntry *entry;
+    size_t entries;
+    uint32_t count, ctr;
+    int fd;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+
+    if (0 > (fd = open(path, O_RDONLY))) {
+        return SUCCESS;
+    }
+    if (0 != fstat(fd, &st)) {
+        close(fd);
+        return GENERAL_ERROR;
+    }
+    if ((size_t)st.st_size < sizeof(planCacheHeader) + sizeof(planCacheEntry)) {
+        close(fd);
+        return SUCCESS;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+        return GENERAL_ERROR;
+    }
+
+    hdr = (const planCacheHeader *)map;
+    if (!headerValid(hdr)) {
+        munmap(map, (size_t)st.st_size);
+        return SUCCESS;
+    }
+    // a writer that died between appending an entry and counting it leaves a partial tail
+    entries = ((size_t)st.st_size - sizeof(planCacheHeader)) / sizeof(planCacheEntry);
+    count = hdr->count < entries ? hdr->count : (uint32_t)entries;
+    entry = (const planCacheEntry *)((const uint8_t *)map + sizeof(planCacheHeader));
+    for (ctr=0; ctr<count; ctr++) {
+        if (!planValid(&entry[ctr].plan)) {
+            // damaged, or not written by this tool
+            munmap(map, (size_t)st.st_size);
+            return GENERAL_ERROR;
+        }
+    }
+    cache->map = (const uint8_t *)map;
+    cache->mapSize = (size_t)st.st_size;
+    cache->count = count;
+    return SUCCESS;
+}
+
+/*
+    Entry:
+            cache points to an open cache
+            id is the eip712_schema_id() of the types to look up
+    Exit:
+            returns the plan in the mapped file, or NULL if id is not cached
+*/
+const eip712Plan *planCacheFind(const planCache *cache, const uint8_t *id) {
+    const planCacheEntry *entry;
+    uint32_t ctr;
+
+    if (NULL == cache->map) {
+        return NULL;
+    }
+    entry = (const planCacheEntry *)(cache->map + sizeof(planCacheHeader));
+    for (ctr=0; ctr<cache->count; ctr++, entry++) {
+        if (0 == memcmp(entry->schemaId, id, sizeof(entry->schemaId))) {
+            return &entry->plan;
+        }
+    }
+    return NULL;
+}
+
+// appends plan to the locked cache file fd, unless id is already there
+static int appendPlan(int fd, const uint8_t *id, const eip712Plan *plan) {
+    planCacheHeader hdr;
+    planCacheEntry entry;
+    struct stat st;
+    off_t offset;
+    uint32_t ctr;
+
+    if (0 != fstat(fd, &st)) {
+        return GENERAL_ERROR;
+    }
+    if (0 == st.st_size) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PLAN_CACHE_MAGIC, sizeof(hdr.magic));
+        hdr.version = PLAN_CACHE_VERSION;
+        hdr.planSize = sizeof(eip712Plan);
+    } else if (sizeof(hdr) != pread(fd, &hdr, sizeof(hdr), 0) || !headerValid(&hdr)) {
+        // written by another build, which may still have it mapped
+        return GENERAL_ERROR;
+    }
+
+    // another process may have added it since this cache was opened
+    for (ctr=0; ctr<hdr.count; ctr++) {
+        offset = (off_t)(sizeof(hdr) + (size_t)ctr * sizeof(entry));
+        if (sizeof(entry.schemaId) != pread(fd, entry.schemaId, sizeof(entry.schemaId), offset)) {
+            break;
+        }
+        if (0 == memcmp(entry.schemaId, id, sizeof(entry.schemaId))) {
+            return SUCCESS;
+        }
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.schemaId, id, sizeof(entry.schemaId));
+    memcpy(&entry.plan, plan, sizeof(entry.plan));
+    offset = (off_t)(sizeof(hdr) + (size_t)hdr.count * sizeof(entry));
+    if (sizeof(entry) != pwrite(fd, &entry, sizeof(entry), offset)) {
+        return GENERAL_ERROR;
+    }
+    hdr.count++;
+    if (sizeof(hdr) != pwrite(fd, &hdr, sizeof(hdr), 0)) {
+        return GENERAL_ERROR;
+    }
+    return SUCCESS;
+}
+
+/*
+    Entry:
+            cache points to an open cache
+            id is the eip712_schema_id() of the types the plan was compiled from
+            plan points to the compiled plan
+    Exit:
+            plan is appended to the cache file under an exclusive lock, so concurrent
+            processes may share one file. The open mapping is not changed, the entry is
+            seen by the next planCacheOpen().
+            returns SUCCESS, or GENERAL_ERROR if the file cannot be written or belongs to
+            an incompatible build
+*/
+int planCacheAdd(planCache *cache, const uint8_t *id, const eip712Plan *plan) {
+    int fd, errRet;
+
+    if (0 > (fd = open(cache->path, O_RDWR | O_CREAT, 0644))) {
+        return GENERAL_ERROR;
+    }
+    if (0 != flock(fd, LOCK_EX)) {
+        close(fd);
+        return GENERAL_ERROR;
+    }
+    errRet = appendPlan(fd, id, plan);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return errRet;
+}
+
+void planCacheClose(planCache *cache) {
+    if (NULL != cache->map) {
+        munmap((void *)cache->map, cache->mapSize);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    On-disk cache of compiled plans (see compile_plan() in eip712.c), keyed by the keccak of
+    the canonical "types" json, eip712_schema_id(). The file is memory mapped read-only when
+    opened, and a plan found there is used in place, so a warm process does no parseType()
+    work at all.
+
+    File layout:
+        planCacheHeader
+        planCacheEntry[count]
+    A file with a different version or plan size is ignored: nothing is found in it and
+    nothing is added to it. A file with a plan that does not pass the checks on open is not
+    used at all. Delete it to start over.
+*/
+
+#ifndef __PLAN_CACHE_H__
+#define __PLAN_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "keepkey/firmware/eip712.h"
+#include "keepkey/firmware/tiny-json.h"
+
+#define PLAN_CACHE_MAGIC    "EIP712PC"
+#define PLAN_CACHE_VERSION  4
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t planSize;      // sizeof(eip712Plan) of the writer
+    uint32_t count;         // number of entries
+    uint8_t reserved[12];
+} planCacheHeader;
+
+typedef struct {
+    uint8_t schemaId[32];
+    eip712Plan plan;
+} planCacheEntry;
+
+typedef struct {
+    const char *path;
+    const uint8_t *map;     // mapped file, NULL if there is nothing to map
+    size_t mapSize;
+    uint32_t count;         // entries usable in map
+} planCache;
+
+int planCacheOpen(planCache *cache, const char *path);
+const eip712Plan *planCacheFind(const planCache *cache, const uint8_t *id);
+int planCacheAdd(planCache *cache, const uint8_t *id, const eip712Plan *plan);
+void planCacheClose(planCache *cache);
+
+#endif
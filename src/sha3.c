@@ -93,6 +93,103 @@ void sha3_512_Init(SHA3_CTX *ctx)
 	keccak_Init(ctx, 512);
 }
 
+#ifdef SHA3_UNROLLED
+/*
+ * Unrolled Keccak-f[1600] (build with -DSHA3_UNROLLED, see makefile KECCAK=).
+ * The 25 lanes live in locals named by row (b g k m s) and column (a e i o u),
+ * e.g. Age is A[1 + 5*1]. Two rounds are expanded per loop iteration, state A
+ * into E and back, so nothing is stored to memory between rounds.
+ *
+ * Lane complementing: lanes be, bi, go, ki, mi and sa are kept inverted while
+ * the permutation runs, which turns most of the NOT-AND terms of chi into
+ * plain AND/OR and leaves one NOT per row.
+ */
+#ifdef SHA3_BMI2
+/* rotate with BMI2 rorx: separate destination register and no flags update */
+#define KROL(dst, src, n) __asm__("rorxq %2, %1, %0" : "=r"(dst) : "r"((uint64_t)(src)), "i"(64 - (n)))
+#else
+#define KROL(dst, src, n) ((dst) = ROTL64((src), (n)))
+#endif
+
+#define KECCAK_ROUND(A, E, rc) \
+	Ca = A##ba ^ A##ga ^ A##ka ^ A##ma ^ A##sa; \
+	Ce = A##be ^ A##ge ^ A##ke ^ A##me ^ A##se; \
+	Ci = A##bi ^ A##gi ^ A##ki ^ A##mi ^ A##si; \
+	Co = A##bo ^ A##go ^ A##ko ^ A##mo ^ A##so; \
+	Cu = A##bu ^ A##gu ^ A##ku ^ A##mu ^ A##su; \
+	KROL(Da, Ce, 1); Da ^= Cu; \
+	KROL(De, Ci, 1); De ^= Ca; \
+	KROL(Di, Co, 1); Di ^= Ce; \
+	KROL(Do, Cu, 1); Do ^= Ci; \
+	KROL(Du, Ca, 1); Du ^= Co; \
+	\
+	Ba = A##ba ^ Da; KROL(Be, A##ge ^ De, 44); KROL(Bi, A##ki ^ Di, 43); \
+	KROL(Bo, A##mo ^ Do, 21); KROL(Bu, A##su ^ Du, 14); \
+	E##ba = Ba ^ (Be | Bi) ^ (rc); \
+	E##be = Be ^ (~Bi | Bo); \
+	E##bi = Bi ^ (Bo & Bu); \
+	E##bo = Bo ^ (Bu | Ba); \
+	E##bu = Bu ^ (Ba & Be); \
+	\
+	KROL(Ba, A##bo ^ Do, 28); KROL(Be, A##gu ^ Du, 20); KROL(Bi, A##ka ^ Da, 3); \
+	KROL(Bo, A##me ^ De, 45); KROL(Bu, A##si ^ Di, 61); \
+	E##ga = Ba ^ (Be | Bi); \
+	E##ge = Be ^ (Bi & Bo); \
+	E##gi = Bi ^ (Bo | ~Bu); \
+	E##go = Bo ^ (Bu | Ba); \
+	E##gu = Bu ^ (Ba & Be); \
+	\
+	KROL(Ba, A##be ^ De, 1); KROL(Be, A##gi ^ Di, 6); KROL(Bi, A##ko ^ Do, 25); \
+	KROL(Bo, A##mu ^ Du, 8); KROL(Bu, A##sa ^ Da, 18); \
+	E##ka = Ba ^ (Be | Bi); \
+	E##ke = Be ^ (Bi & Bo); \
+	E##ki = Bi ^ (~Bo & Bu); \
+	E##ko = ~Bo ^ (Bu | Ba); \
+	E##ku = Bu ^ (Ba & Be); \
+	\
+	KROL(Ba, A##bu ^ Du, 27); KROL(Be, A##ga ^ Da, 36); KROL(Bi, A##ke ^ De, 10); \
+	KROL(Bo, A##mi ^ Di, 15); KROL(Bu, A##so ^ Do, 56); \
+	E##ma = Ba ^ (Be & Bi); \
+	E##me = Be ^ (Bi | Bo); \
+	E##mi = Bi ^ (~Bo | Bu); \
+	E##mo = ~Bo ^ (Bu & Ba); \
+	E##mu = Bu ^ (Ba | Be); \
+	\
+	KROL(Ba, A##bi ^ Di, 62); KROL(Be, A##go ^ Do, 55); KROL(Bi, A##ku ^ Du, 39); \
+	KROL(Bo, A##ma ^ Da, 41); KROL(Bu, A##se ^ De, 2); \
+	E##sa = Ba ^ (~Be & Bi); \
+	E##se = ~Be ^ (Bi | Bo); \
+	E##si = Bi ^ (Bo & Bu); \
+	E##so = Bo ^ (Bu | Ba); \
+	E##su = Bu ^ (Ba & Be);
+
+static void sha3_permutation(uint64_t *state)
+{
+	uint64_t Aba, Abe, Abi, Abo, Abu, Aga, Age, Agi, Ago, Agu, Aka, Ake, Aki, Ako, Aku;
+	uint64_t Ama, Ame, Ami, Amo, Amu, Asa, Ase, Asi, Aso, Asu;
+	uint64_t Eba, Ebe, Ebi, Ebo, Ebu, Ega, Ege, Egi, Ego, Egu, Eka, Eke, Eki, Eko, Eku;
+	uint64_t Ema, Eme, Emi, Emo, Emu, Esa, Ese, Esi, Eso, Esu;
+	uint64_t Ba, Be, Bi, Bo, Bu, Ca, Ce, Ci, Co, Cu, Da, De, Di, Do, Du;
+	int round;
+
+	Aba =  state[ 0]; Abe = ~state[ 1]; Abi = ~state[ 2]; Abo =  state[ 3]; Abu =  state[ 4];
+	Aga =  state[ 5]; Age =  state[ 6]; Agi =  state[ 7]; Ago = ~state[ 8]; Agu =  state[ 9];
+	Aka =  state[10]; Ake =  state[11]; Aki = ~state[12]; Ako =  state[13]; Aku =  state[14];
+	Ama =  state[15]; Ame =  state[16]; Ami = ~state[17]; Amo =  state[18]; Amu =  state[19];
+	Asa = ~state[20]; Ase =  state[21]; Asi =  state[22]; Aso =  state[23]; Asu =  state[24];
+
+	for (round = 0; round < NumberOfRounds; round += 2) {
+		KECCAK_ROUND(A, E, keccak_round_constants[round])
+		KECCAK_ROUND(E, A, keccak_round_constants[round + 1])
+	}
+
+	state[ 0] =  Aba; state[ 1] = ~Abe; state[ 2] = ~Abi; state[ 3] =  Abo; state[ 4] =  Abu;
+	state[ 5] =  Aga; state[ 6] =  Age; state[ 7] =  Agi; state[ 8] = ~Ago; state[ 9] =  Agu;
+	state[10] =  Aka; state[11] =  Ake; state[12] = ~Aki; state[13] =  Ako; state[14] =  Aku;
+	state[15] =  Ama; state[16] =  Ame; state[17] = ~Ami; state[18] =  Amo; state[19] =  Amu;
+	state[20] = ~Asa; state[21] =  Ase; state[22] =  Asi; state[23] =  Aso; state[24] =  Asu;
+}
+#else
 /* Keccak theta() transformation */
 static void keccak_theta(uint64_t *A)
 {
@@ -203,6 +300,7 @@ static void sha3_permutation(uint64_t *state)
 		*state ^= keccak_round_constants[round];
 	}
 }
+#endif /* SHA3_UNROLLED */
 
 /**
  * The core transformation. Process the specified block of data.
@@ -378,6 +476,333 @@ void keccak_512(const unsigned char* data, size_t len, unsigned char* digest)
 	keccak_Update(&ctx, data, len);
 	keccak_Final(&ctx, digest);
 }
+
+/* keccak padding bits for a 256-bit digest: 0x01 after the data, 0x80 in the last rate byte */
+#define KECCAK256_PAD_FIRST I64(0x0000000000000001)
+#define KECCAK256_PAD_LAST  I64(0x8000000000000000)
+#define KECCAK256_PAD_WORD  (SHA3_256_BLOCK_LENGTH / 8 - 1)
+
+/**
+ * Calculate keccak-256 of exactly 32 bytes.
+ * The input fits in one rate block, so it is absorbed straight into a local
+ * state without a SHA3_CTX.
+ *
+ * @param data 32 bytes to hash
+ * @param digest 32-byte result buffer
+ */
+void keccak256_32(const unsigned char* data, unsigned char* digest)
+{
+	uint64_t st[25] = {0};
+
+	memcpy(st, data, 32);
+	st[0] = le2me_64(st[0]);
+	st[1] = le2me_64(st[1]);
+	st[2] = le2me_64(st[2]);
+	st[3] = le2me_64(st[3]);
+	st[4] = KECCAK256_PAD_FIRST;
+	st[KECCAK256_PAD_WORD] = KECCAK256_PAD_LAST;
+	sha3_permutation(st);
+	me64_to_le_str(digest, st, sha3_256_hash_size);
+	memzero(st, sizeof(st));
+}
+
+/**
+ * Calculate keccak-256 of exactly 64 bytes, e.g. two concatenated hashes.
+ *
+ * @param data 64 bytes to hash
+ * @param digest 32-byte result buffer
+ */
+void keccak256_64(const unsigned char* data, unsigned char* digest)
+{
+	uint64_t st[25] = {0};
+	int i;
+
+	memcpy(st, data, 64);
+	for (i = 0; i < 8; i++) {
+		st[i] = le2me_64(st[i]);
+	}
+	st[8] = KECCAK256_PAD_FIRST;
+	st[KECCAK256_PAD_WORD] = KECCAK256_PAD_LAST;
+	sha3_permutation(st);
+	me64_to_le_str(digest, st, sha3_256_hash_size);
+	memzero(st, sizeof(st));
+}
+
+/**
+ * Calculate keccak-256 of a message shorter than one rate block, e.g. the
+ * 66-byte EIP-712 signing preimage. One permutation, no SHA3_CTX.
+ *
+ * @param data message to hash
+ * @param len message length, less than SHA3_256_BLOCK_LENGTH
+ * @param digest 32-byte result buffer
+ */
+void keccak256_block(const unsigned char* data, size_t len, unsigned char* digest)
+{
+	uint64_t st[25] = {0};
+	unsigned char *bytes = (unsigned char *)st;
+	int i;
+
+	memcpy(st, data, len);
+	bytes[len] ^= 0x01;
+	bytes[SHA3_256_BLOCK_LENGTH - 1] ^= 0x80;
+	for (i = 0; i < SHA3_256_BLOCK_LENGTH / 8; i++) {
+		st[i] = le2me_64(st[i]);
+	}
+	sha3_permutation(st);
+	me64_to_le_str(digest, st, sha3_256_hash_size);
+	memzero(st, sizeof(st));
+}
+
+/**
+ * Calculate keccak-256 of n concatenated 32-byte words.
+ * Every block boundary and the padding position fall on a 64-bit lane, so
+ * the words are xored into a local state lane by lane.
+ *
+ * @param data n * 32 bytes to hash
+ * @param words number of 32-byte words
+ * @param digest 32-byte result buffer
+ */
+void keccak256_words(const unsigned char* data, size_t words, unsigned char* digest)
+{
+	uint64_t st[25] = {0};
+	uint64_t lane;
+	size_t len = words * 32;
+	size_t i;
+
+	while (len >= SHA3_256_BLOCK_LENGTH) {
+		for (i = 0; i < SHA3_256_BLOCK_LENGTH / 8; i++) {
+			memcpy(&lane, data + 8 * i, 8);
+			st[i] ^= le2me_64(lane);
+		}
+		sha3_permutation(st);
+		data += SHA3_256_BLOCK_LENGTH;
+		len  -= SHA3_256_BLOCK_LENGTH;
+	}
+	for (i = 0; i < len / 8; i++) {
+		memcpy(&lane, data + 8 * i, 8);
+		st[i] ^= le2me_64(lane);
+	}
+	st[len / 8] ^= KECCAK256_PAD_FIRST;
+	st[KECCAK256_PAD_WORD] ^= KECCAK256_PAD_LAST;
+	sha3_permutation(st);
+	me64_to_le_str(digest, st, sha3_256_hash_size);
+	memzero(st, sizeof(st));
+}
+
+/*
+ * Multi-buffer keccak-256.
+ *
+ * Independent messages are assigned to the lanes of an interleaved state
+ * (word w of lane j lives at st[w * lanes + j]) and all lanes are permuted
+ * together by a SIMD Keccak-f[1600]. When a lane absorbs its final block its
+ * digest is extracted and the lane is refilled with the next pending message,
+ * so short and long messages can be mixed without idling the other lanes.
+ */
+#define KECCAK_MB_MAX_LANES 8
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KECCAK_MB_X86 1
+#include <immintrin.h>
+
+/* rotation offsets of rho() and destination lane of pi(), by source lane */
+static const uint8_t keccak_rho[25] = {
+	 0,  1, 62, 28, 27, 36, 44,  6, 55, 20,  3, 10, 43,
+	25, 39, 41, 45, 15, 21,  8, 18,  2, 61, 56, 14
+};
+static const uint8_t keccak_pi_dst[25] = {
+	 0, 10, 20,  5, 15, 16,  1, 11, 21,  6,  7, 17,  2,
+	12, 22, 23,  8, 18,  3, 13, 14, 24,  9, 19,  4
+};
+
+/* 4-way Keccak-f[1600], one lane per 64-bit element of a 256-bit vector */
+__attribute__((target("avx2")))
+static void keccak_f1600_x4(uint64_t *st)
+{
+	__m256i A[25], B[25], C[5], D;
+	int i, x, y, round;
+
+	for (i = 0; i < 25; i++) {
+		A[i] = _mm256_loadu_si256((const __m256i*)(st + 4 * i));
+	}
+	for (round = 0; round < NumberOfRounds; round++) {
+		/* theta */
+		for (x = 0; x < 5; x++) {
+			C[x] = _mm256_xor_si256(_mm256_xor_si256(A[x], A[x + 5]),
+				_mm256_xor_si256(_mm256_xor_si256(A[x + 10], A[x + 15]), A[x + 20]));
+		}
+		for (x = 0; x < 5; x++) {
+			D = _mm256_xor_si256(C[(x + 4) % 5],
+				_mm256_or_si256(_mm256_slli_epi64(C[(x + 1) % 5], 1),
+				                _mm256_srli_epi64(C[(x + 1) % 5], 63)));
+			for (y = 0; y < 25; y += 5) {
+				A[x + y] = _mm256_xor_si256(A[x + y], D);
+			}
+		}
+		/* rho and pi; a shift count of 64 yields zero, so offset 0 is a copy */
+		for (i = 0; i < 25; i++) {
+			B[keccak_pi_dst[i]] = _mm256_or_si256(
+				_mm256_sllv_epi64(A[i], _mm256_set1_epi64x(keccak_rho[i])),
+				_mm256_srlv_epi64(A[i], _mm256_set1_epi64x(64 - keccak_rho[i])));
+		}
+		/* chi */
+		for (y = 0; y < 25; y += 5) {
+			for (x = 0; x < 5; x++) {
+				A[x + y] = _mm256_xor_si256(B[x + y],
+					_mm256_andnot_si256(B[(x + 1) % 5 + y], B[(x + 2) % 5 + y]));
+			}
+		}
+		/* iota */
+		A[0] = _mm256_xor_si256(A[0], _mm256_set1_epi64x((long long)keccak_round_constants[round]));
+	}
+	for (i = 0; i < 25; i++) {
+		_mm256_storeu_si256((__m256i*)(st + 4 * i), A[i]);
+	}
+}
+
+/* 8-way Keccak-f[1600] using AVX-512 rotates and ternary logic */
+__attribute__((target("avx512f")))
+static void keccak_f1600_x8(uint64_t *st)
+{
+	__m512i A[25], B[25], C[5], D;
+	int i, x, y, round;
+
+	for (i = 0; i < 25; i++) {
+		A[i] = _mm512_loadu_si512((const void*)(st + 8 * i));
+	}
+	for (round = 0; round < NumberOfRounds; round++) {
+		/* theta, 0x96 is a three-way xor */
+		for (x = 0; x < 5; x++) {
+			C[x] = _mm512_ternarylogic_epi64(
+				_mm512_ternarylogic_epi64(A[x], A[x + 5], A[x + 10], 0x96),
+				A[x + 15], A[x + 20], 0x96);
+		}
+		for (x = 0; x < 5; x++) {
+			D = _mm512_xor_si512(C[(x + 4) % 5], _mm512_rol_epi64(C[(x + 1) % 5], 1));
+			for (y = 0; y < 25; y += 5) {
+				A[x + y] = _mm512_xor_si512(A[x + y], D);
+			}
+		}
+		/* rho and pi */
+		for (i = 0; i < 25; i++) {
+			B[keccak_pi_dst[i]] = _mm512_rolv_epi64(A[i], _mm512_set1_epi64(keccak_rho[i]));
+		}
+		/* chi, 0xD2 is a ^ (~b & c) */
+		for (y = 0; y < 25; y += 5) {
+			for (x = 0; x < 5; x++) {
+				A[x + y] = _mm512_ternarylogic_epi64(B[x + y],
+					B[(x + 1) % 5 + y], B[(x + 2) % 5 + y], 0xD2);
+			}
+		}
+		/* iota */
+		A[0] = _mm512_xor_si512(A[0], _mm512_set1_epi64((long long)keccak_round_constants[round]));
+	}
+	for (i = 0; i < 25; i++) {
+		_mm512_storeu_si512((void*)(st + 8 * i), A[i]);
+	}
+}
+#endif /* KECCAK_MB_X86 */
+
+/**
+ * Hash n messages on a lane-interleaved state with the given permutation.
+ */
+static void keccak_256_lanes(const unsigned char* const data[], const size_t len[],
+		unsigned char* const digest[], size_t n, unsigned lanes,
+		void (*permute)(uint64_t *st))
+{
+	uint64_t st[25 * KECCAK_MB_MAX_LANES] = {0};
+	uint64_t block[SHA3_256_BLOCK_LENGTH / 8];
+	size_t msg[KECCAK_MB_MAX_LANES];   /* message index held by each lane */
+	size_t off[KECCAK_MB_MAX_LANES];   /* bytes of that message absorbed */
+	int final[KECCAK_MB_MAX_LANES];
+	size_t next = 0, active = 0;
+	unsigned j, w;
+
+	for (j = 0; j < lanes; j++) {
+		msg[j] = (next < n) ? next++ : n;
+		off[j] = 0;
+		active += (msg[j] < n);
+	}
+
+	while (active) {
+		for (j = 0; j < lanes; j++) {
+			size_t left;
+			final[j] = 0;
+			if (msg[j] >= n) continue;
+
+			left = len[msg[j]] - off[j];
+			if (left >= SHA3_256_BLOCK_LENGTH) {
+				memcpy(block, data[msg[j]] + off[j], SHA3_256_BLOCK_LENGTH);
+				off[j] += SHA3_256_BLOCK_LENGTH;
+			} else {
+				/* last, padded block */
+				memzero(block, sizeof(block));
+				if (left) memcpy(block, data[msg[j]] + off[j], left);
+				((unsigned char*)block)[left] |= 0x01;
+				((unsigned char*)block)[SHA3_256_BLOCK_LENGTH - 1] |= 0x80;
+				final[j] = 1;
+			}
+			for (w = 0; w < SHA3_256_BLOCK_LENGTH / 8; w++) {
+				st[w * lanes + j] ^= le2me_64(block[w]);
+			}
+		}
+
+		permute(st);
+
+		for (j = 0; j < lanes; j++) {
+			if (!final[j]) continue;
+
+			for (w = 0; w < sha3_256_hash_size / 8; w++) {
+				uint64_t word = st[w * lanes + j];
+				me64_to_le_str(digest[msg[j]] + 8 * w, &word, 8);
+			}
+			for (w = 0; w < 25; w++) {
+				st[w * lanes + j] = 0;
+			}
+			if (next < n) {
+				msg[j] = next++;
+				off[j] = 0;
+			} else {
+				msg[j] = n;
+				active--;
+			}
+		}
+	}
+	memzero(st, sizeof(st));
+	memzero(block, sizeof(block));
+}
+
+/**
+ * Calculate keccak-256 of n independent messages in one pass.
+ * Produces exactly keccak_256(data[i], len[i], digest[i]) for every i,
+ * using an AVX-512 or AVX2 multi-buffer core when the CPU supports one.
+ *
+ * @param data array of n message pointers
+ * @param len array of n message lengths
+ * @param digest array of n pointers to 32-byte result buffers
+ * @param n number of messages
+ */
+void keccak_256_multi(const unsigned char* const data[], const size_t len[],
+		unsigned char* const digest[], size_t n)
+{
+	size_t i;
+
+#if KECCAK_MB_X86
+	if (n > 1) {
+		__builtin_cpu_init();
+		if (n > 4 && __builtin_cpu_supports("avx512f")) {
+			keccak_256_lanes(data, len, digest, n, 8, keccak_f1600_x8);
+			return;
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			keccak_256_lanes(data, len, digest, n, 4, keccak_f1600_x4);
+			return;
+		}
+	}
+#endif
+	for (i = 0; i < n; i++) {
+		keccak_256(data[i], len[i], digest[i]);
+	}
+}
 #endif /* USE_KECCAK */
 
 void sha3_256(const unsigned char* data, size_t len, unsigned char* digest)
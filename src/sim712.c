@@ -27,16 +27,28 @@
         requires all complete json message strings to be enclosed by braces, i.e., { ... }
         Cannot have entire json string quoted, i.e., "{ ... }" will not work.
         Remove all quote escape chars, e.g., {"types":  not  {\"types\":
-    int: Strings representing ints must fit into a long size. 
-        Note: Do not prefix ints or uints with 0x
+    ints: json numbers or strings, decimal or 0x prefixed hex, with an optional '-' sign.
+        Values are 256-bit and must fit the intN/uintN width. Decimals may have a fraction
+        and exponent if the value is whole, e.g., 1e+21.
     All hex and byte strings must be big-endian
     Byte strings and address should be prefixed by 0x
 */
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "./colors.h"
+#include "./eip712_batch.h"
+#include "./plan_cache.h"
+#include "./stream_reader.h"
 
 #include "keepkey/board/confirm_sm.h"
 #include "keepkey/firmware/eip712.h"
@@ -44,117 +56,566 @@
 
 // eip712tool specific defines
 //#define DISPLAY_INTERMEDIATES 1     // define this to display intermediate hash results
-#define BUFSIZE             4000
-#define PRIMETYPE_BUFSIZE    80
-#define DOMAIN_BUFSIZE      300
-#define MESSAGE_BUFSIZE     2000
-#define TYPES_BUFSIZE       2000                    // This will be used as the types,values concatenated string
+#define READ_CHUNK          65536                   // first buffer size for input that is not a regular file
+#define USAGE   "USAGE: ./sim712.exe [--plan-cache <cachefile>] <filename>\n" \
+                "       ./sim712.exe --jobs <N> <filename> [<filename> ...]\n" \
+                "  Where <filename> is a properly formatted EIP-712 message.\n" \
+                "  --plan-cache keeps compiled types in <cachefile> for later runs, single file\n" \
+                "  only: it cannot be combined with --jobs, --dir, --stream, --verify, --format\n" \
+                "  or more than one file.\n" \
+                "  --jobs encodes all files on N threads (0 is one per cpu) and prints one\n" \
+                "  line of hashes per file, in command line order.\n" \
+                "  --array-threshold <M> with --jobs encodes elements of struct arrays with at\n" \
+                "  least M elements on all threads when given a single file.\n" \
+                "  --digest also prints the signing digest keccak(0x1901 || domainSeparator || message).\n" \
+                "  --stream reads one document per line from stdin and prints one line of hashes,\n" \
+                "  digest and status per document.\n" \
+                "  --verify checks the hashes against the \"results\" block of every document, exits\n" \
+                "  with 2 if one does not match or a document could not be encoded. A block\n" \
+                "  without domain_separator_hash and message_hash counts as no results.\n" \
+                "  --format text|json|csv sets the output of --jobs, --stream and --verify.\n" \
+                "  --dir <path> adds the .json files of path, in name order, to the files\n" \
+                "  encoded in one run. Throughput and error counts go to stderr.\n"
 // Example
 // DEBUG_DISPLAY_VAL("sig", "sig %s", 65, resp->signature.bytes[ctr]);
 
 
-int parseJsonName(char *name, char *jsonMsg, char *parsedJson, unsigned maxParsedSize) {
-    char *secStart, *brack, *brackTest, *typeEnd;
-    unsigned brackLevel, parsedSize;
-    
-    if (NULL == (secStart = strstr(jsonMsg, name))) {
-        printf("%s not found!\n", name);
+typedef struct {
+    char *text;                     // nul terminated contents, writable for in place parsing
+    size_t size;                    // without the nul
+    size_t mapSize;                 // bytes mapped, 0 if text was read into the heap
+} inputFile;
+
+/*
+    Entry:
+            fileName is a file, pipe or device
+            in points to caller allocated inputFile
+    Exit:
+            in holds the whole input, release it with unloadFile()
+            returns 1, or 0 if the input cannot be read
+    Regular files are mapped copy on write, over a zeroed anonymous mapping one byte longer
+    so the nul past the end is there even when the size is a multiple of the page. Other
+    input is read into a buffer doubled as it fills.
+*/
+int loadFile(const char *fileName, inputFile *in) {
+    struct stat st;
+    size_t bufSize;
+    ssize_t got;
+    char *buf;
+    int fd;
+
+    memset(in, 0, sizeof(inputFile));
+    if (0 > (fd = open(fileName, O_RDONLY))) {
         return 0;
     }
+    if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && 0 < st.st_size) {
+        in->size = (size_t)st.st_size;
+        in->mapSize = in->size + 1;
+        buf = mmap(NULL, in->mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == buf ||
+            MAP_FAILED == mmap(buf, in->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+            if (MAP_FAILED != buf) {
+                munmap(buf, in->mapSize);
+            }
+            close(fd);
+            return 0;
+        }
+        // the file's last page is zero filled past its end, or the anonymous page follows it
+        in->text = buf;
+        close(fd);
+        return 1;
+    }
 
-    if (0 != strncmp(name, "\"primaryType\"", strlen(name))) {
-        brackLevel = 1;
-        brack = strstr(secStart, "{");
-        while (brackLevel > 0) {
-            brackTest = strpbrk(brack+1, "{}");
-            if ('{' == *brackTest) {
-                brackLevel++;
-            } else if ('}' == *brackTest) {
-                brackLevel--;
-            } else if (0 == brackTest) {
-                printf("can't parse %s value!\n", name);
-                return 0;
+    bufSize = READ_CHUNK;
+    if (NULL == (in->text = malloc(bufSize))) {
+        close(fd);
+        return 0;
+    }
+    while (0 < (got = read(fd, &in->text[in->size], bufSize - in->size - 1))) {
+        in->size += (size_t)got;
+        if (in->size + 1 == bufSize) {
+            if (NULL == (buf = realloc(in->text, bufSize * 2))) {
+                got = -1;
+                break;
             }
-            brack = brackTest;
+            in->text = buf;
+            bufSize *= 2;
         }
+    }
+    close(fd);
+    if (0 > got) {
+        free(in->text);
+        in->text = NULL;
+        return 0;
+    }
+    in->text[in->size] = '\0';
+    return 1;
+}
+
+void unloadFile(inputFile *in) {
+    if (0 != in->mapSize) {
+        munmap(in->text, in->mapSize);
+    } else {
+        free(in->text);
+    }
+    in->text = NULL;
+}
+
+#define FORMAT_TEXT         0       // "name value" pairs, one line per document
+#define FORMAT_JSON         1       // one json object per line per document
+#define FORMAT_CSV          2       // a header row, then one row per document
+#define EXIT_VERIFY_FAILED  2       // --verify found a document that does not match or fails to encode
+#define BATCH_GROUP_FILES   4096    // files mapped and encoded at a time
+
+typedef struct {
+    int format;
+    int digest;                     // text format prints the digest
+    int status;                     // text format prints the status
+    int verify;                     // results are checked against the documents
+    unsigned passed, failed, unchecked;
+    unsigned hits, misses;          // domain separator cache
+    unsigned long documents, errors;  // errors: no digest, or not verified
+    unsigned long unreadable;
+    unsigned long long bytes;
+    struct timespec start;
+} outputState;
 
-        parsedSize = brack-secStart+1;
-        if (parsedSize+2 > maxParsedSize) {
-            printf("parsed size is %u, larger than max allowed %u\n", parsedSize, maxParsedSize);
+typedef struct {
+    char **names;                   // copies, freed by freeFiles()
+    unsigned count, size;
+} fileList;
+
+// Appends dir/name, or name if dir is NULL. Returns 0 if out of memory.
+int addFile(fileList *list, const char *dir, const char *name) {
+    size_t dirLen = NULL != dir ? strlen(dir) + 1 : 0;
+    char **names, *path;
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        if (NULL == (names = realloc(list->names, list->size * sizeof(char *)))) {
             return 0;
         }
+        list->names = names;
+    }
+    if (NULL == (path = malloc(dirLen + strlen(name) + 1))) {
+        return 0;
+    }
+    if (NULL != dir) {
+        memcpy(path, dir, dirLen - 1);
+        path[dirLen - 1] = '/';
+    }
+    strcpy(&path[dirLen], name);
+    list->names[list->count++] = path;
+    return 1;
+}
+
+int compareNames(const void *left, const void *right) {
+    return strcmp(*(char *const *)left, *(char *const *)right);
+}
+
+// Appends the .json files of dir in name order. Returns 0 if dir cannot be read.
+int addDir(fileList *list, const char *dir) {
+    struct dirent *entry;
+    unsigned first = list->count;
+    size_t len;
+    DIR *dirp;
+    int ok = 1;
+
+    if (NULL == (dirp = opendir(dir))) {
+        return 0;
+    }
+    while (ok && NULL != (entry = readdir(dirp))) {
+        len = strlen(entry->d_name);
+        if (len > 5 && 0 == strcmp(&entry->d_name[len-5], ".json")) {
+            ok = addFile(list, dir, entry->d_name);
+        }
+    }
+    closedir(dirp);
+    qsort(&list->names[first], list->count - first, sizeof(char *), compareNames);
+    return ok;
+}
+
+void freeFiles(fileList *list) {
+    unsigned ctr;
+
+    for (ctr=0; ctr<list->count; ctr++) {
+        free(list->names[ctr]);
+    }
+    free(list->names);
+}
+
+double secondsSince(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// writes a hash as 64 lower case hex digits
+void putHash(const uint8_t *hash) {
+    static const char digits[] = "0123456789abcdef";
+    char hex[64];
+    int ctr;
+
+    for (ctr=0; ctr<32; ctr++) {
+        hex[2*ctr] = digits[hash[ctr] >> 4];
+        hex[2*ctr+1] = digits[hash[ctr] & 0xf];
+    }
+    fwrite(hex, 1, sizeof(hex), stdout);
+}
+
+// writes text as a json string or csv field
+void putQuoted(const char *text, int format) {
+    if (FORMAT_CSV == format && NULL == strpbrk(text, ",\"\r\n")) {
+        fputs(text, stdout);
+        return;
+    }
+    putchar('"');
+    for (; '\0' != *text; text++) {
+        if ('"' == *text) {
+            fputs(FORMAT_CSV == format ? "\"\"" : "\\\"", stdout);
+        } else if (FORMAT_JSON == format && '\\' == *text) {
+            fputs("\\\\", stdout);
+        } else if (FORMAT_JSON == format && (unsigned char)*text < 0x20) {
+            printf("\\u%04x", (unsigned char)*text);
+        } else {
+            putchar(*text);
+        }
+    }
+    putchar('"');
+}
+
+void printResultHash(const char *name, int status, const uint8_t *hash) {
+    if (SUCCESS == status) {
+        printf(" %s ", name);
+        putHash(hash);
+    } else if (NULL_MSG_HASH == status) {
+        printf(" %s NULL", name);
+    } else {
+        printf(" %s error %d", name, status);
+    }
+}
+
+// json and csv hash value: the hash, or null/empty with the status in its own field
+void putResultHash(const outputState *out, int status, const uint8_t *hash) {
+    if (SUCCESS == status) {
+        fputs(FORMAT_JSON == out->format ? "\"0x" : "0x", stdout);
+        putHash(hash);
+        if (FORMAT_JSON == out->format) {
+            putchar('"');
+        }
+    } else if (FORMAT_JSON == out->format) {
+        fputs("null", stdout);
+    }
+}
 
-        // json parser wants to see string json string enclosed in braces, i.e., "{ ... }"
-        strcat(parsedJson, "{\0");
-        strncpy(&parsedJson[strlen(parsedJson)], secStart, parsedSize);
-        strcat(parsedJson, "}\0");
+void printHeader(const outputState *out) {
+    if (FORMAT_CSV == out->format) {
+        fputs("input,domainSeparator,dsStatus,message,msgStatus,digest,status,verify\n", stdout);
+    }
+}
 
+void printResult(outputState *out, const char *input, const eip712Result *result) {
+    static const char *const verifyNames[] = {"none", "pass", "fail"};
+
+    out->documents++;
+    out->hits += result->dsCacheHit;
+    out->misses += result->dsCacheMiss;
+    if (SUCCESS != result->digestStatus || VERIFY_FAIL == result->verify) {
+        out->errors++;
+    }
+    if (VERIFY_PASS == result->verify) {
+        out->passed++;
+    } else if (VERIFY_FAIL == result->verify) {
+        out->failed++;
     } else {
-        // primary type parsing is different
-        typeEnd = strpbrk(secStart, ",\n");
-        if (typeEnd == NULL) {
-            printf("parsed size of primaryType is NULL!\n");
-            return 0;
+        out->unchecked++;
+    }
+
+    if (FORMAT_TEXT == out->format) {
+        fputs(input, stdout);
+        printResultHash("domainSeparator", result->dsStatus, result->domainSeparator);
+        printResultHash("message", result->msgStatus, result->msgHash);
+        if (out->digest) {
+            printResultHash("digest", result->digestStatus, result->digest);
         }
-        if (PRIMETYPE_BUFSIZE < (parsedSize = typeEnd-secStart)) {
-            printf("primaryType parsed size is %u, greater than max size allowed %u\n", parsedSize, PRIMETYPE_BUFSIZE);
-            return 0;
+        if (out->status) {
+            printf(" status %d", result->digestStatus);
         }
-        // json parser wants to see string json string enclosed in braces, i.e., "{ ... }"
+        if (out->verify) {
+            printf(" verify %s", verifyNames[result->verify]);
+        }
+        putchar('\n');
+        return;
+    }
+
+    if (FORMAT_JSON == out->format) {
+        fputs("{\"input\":", stdout);
+        putQuoted(input, out->format);
+        fputs(",\"domainSeparator\":", stdout);
+        putResultHash(out, result->dsStatus, result->domainSeparator);
+        printf(",\"dsStatus\":%d,\"message\":", result->dsStatus);
+        putResultHash(out, result->msgStatus, result->msgHash);
+        printf(",\"msgStatus\":%d,\"digest\":", result->msgStatus);
+        putResultHash(out, result->digestStatus, result->digest);
+        printf(",\"status\":%d,\"verify\":\"%s\"}\n", result->digestStatus, verifyNames[result->verify]);
+    } else {
+        putQuoted(input, out->format);
+        putchar(',');
+        putResultHash(out, result->dsStatus, result->domainSeparator);
+        printf(",%d,", result->dsStatus);
+        putResultHash(out, result->msgStatus, result->msgHash);
+        printf(",%d,", result->msgStatus);
+        putResultHash(out, result->digestStatus, result->digest);
+        printf(",%d,%s\n", result->digestStatus, verifyNames[result->verify]);
+    }
+}
+
+/*
+    Prints the counts, on stderr when stdout is json or csv, and the throughput on stderr.
+    Returns EXIT_SUCCESS, EXIT_FAILURE if an input could not be read, or EXIT_VERIFY_FAILED
+    if verifying and a document did not match its "results" block or had an encode error.
+*/
+int finishOutput(const outputState *out) {
+    FILE *summary = FORMAT_TEXT == out->format ? stdout : stderr;
+    double seconds = secondsSince(&out->start);
+
+    fflush(stdout);
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    fprintf(stderr, "%lu documents %.2f MB in %.3f s, %.0f documents/s %.2f MB/s, %lu with errors, "
+            "%lu unreadable\n", out->documents, (double)out->bytes / 1e6, seconds,
+            (double)out->documents / seconds, (double)out->bytes / 1e6 / seconds, out->errors,
+            out->unreadable);
+    fprintf(summary, "domainSeparator cache %u hits %u misses\n", out->hits, out->misses);
+    if (out->verify) {
+        fprintf(summary, "verify %u passed %u failed %u without results\n", out->passed, out->failed,
+                out->unchecked);
+    }
+    if (0 != out->unreadable) {
+        return EXIT_FAILURE;
+    }
+    return out->verify && (0 != out->failed || 0 != out->errors) ? EXIT_VERIFY_FAILED : EXIT_SUCCESS;
+}
+
+/*
+    Encodes the files with eip712_encode_batch(), BATCH_GROUP_FILES at a time so any number
+    of files stays within memory and mapping limits, and prints one result per file in
+    order. In the text format:
+        <filename> domainSeparator <hash> message <hash> [digest <hash>] [verify <result>]
+    A hash is "NULL" for an empty message or "error <n>" with the error list status.
+    A last line counts the domain separators found in and missing from the cache:
+        domainSeparator cache <hits> hits <misses> misses
+    Files that cannot be read are reported on stderr and skipped.
+*/
+int batchMain(char *fileNames[], unsigned numFiles, unsigned jobs, unsigned arrayThreshold, outputState *out) {
+    unsigned groupSize = numFiles < BATCH_GROUP_FILES ? numFiles : BATCH_GROUP_FILES;
+    inputFile *inputs;
+    const char **docs, **names;
+    eip712Result *results;
+    unsigned first, ctr, loaded;
+    int retval = EXIT_SUCCESS;
 
-        strcat(parsedJson, "{\0");
-        strncpy(&parsedJson[strlen(parsedJson)], secStart, parsedSize);
-        if (parsedJson[parsedSize] == ',') {
-            parsedJson[parsedSize-1] = 0;
+    inputs = calloc(groupSize, sizeof(inputFile));
+    docs = calloc(groupSize, sizeof(char *));
+    names = calloc(groupSize, sizeof(char *));
+    results = calloc(groupSize, sizeof(eip712Result));
+    if (NULL == inputs || NULL == docs || NULL == names || NULL == results) {
+        fprintf(stderr, "Out of memory for %u files\n", numFiles);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &out->start);
+    printHeader(out);
+    for (first=0; first<numFiles && EXIT_SUCCESS == retval; first+=groupSize) {
+        loaded = 0;
+        for (ctr=first; ctr<numFiles && ctr-first<groupSize; ctr++) {
+            if (loadFile(fileNames[ctr], &inputs[loaded])) {
+                docs[loaded] = inputs[loaded].text;
+                names[loaded] = fileNames[ctr];
+                out->bytes += inputs[loaded].size;
+                loaded++;
+            } else {
+                fprintf(stderr, "Cannot read %s\n", fileNames[ctr]);
+                out->unreadable++;
+            }
+        }
+        if (SUCCESS != eip712_encode_batch(docs, loaded, results, jobs, arrayThreshold)) {
+            fprintf(stderr, "Batch encode failed\n");
+            retval = EXIT_FAILURE;
+        } else {
+            for (ctr=0; ctr<loaded; ctr++) {
+                printResult(out, names[ctr], &results[ctr]);
+            }
+        }
+        for (ctr=0; ctr<loaded; ctr++) {
+            unloadFile(&inputs[ctr]);
         }
-        strcat(parsedJson, "}\0");
     }
-    return 1;
+    if (EXIT_SUCCESS == retval) {
+        retval = finishOutput(out);
+    }
+
+    free(inputs);
+    free(docs);
+    free(names);
+    free(results);
+    return retval;
 }
 
+void flushOutput(void) {
+    fflush(stdout);
+}
 
+/*
+    Encodes newline delimited documents from stdin and prints one result per document, in
+    the text format:
+        <line> domainSeparator <hash> message <hash> digest <hash> status <n> [verify <result>]
+    status is SUCCESS, or the error list status of the first hash that failed. Reading the
+    next input overlaps encoding, output is flushed whenever the input runs dry.
+*/
+int streamMain(outputState *out) {
+    streamReader reader;
+    batchWorker *worker;
+    eip712Result result;
+    unsigned long lineNum = 0;
+    char input[24];
+    size_t len;
+    char *line;
+    int retval;
+
+    if (NULL == (worker = eip712_worker_new())) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (!streamOpen(&reader, 0)) {
+        fprintf(stderr, "Cannot start reading stdin\n");
+        eip712_worker_free(worker);
+        return EXIT_FAILURE;
+    }
+    reader.idle = flushOutput;
+    out->digest = out->status = 1;
+    clock_gettime(CLOCK_MONOTONIC, &out->start);
+
+    printHeader(out);
+    while (NULL != (line = streamNextLine(&reader, &len))) {
+        lineNum++;
+        if (len == strspn(line, " \t\r")) {
+            continue;
+        }
+        out->bytes += len;
+        eip712_encode_doc(worker, line, &result);
+        snprintf(input, sizeof(input), "%lu", lineNum);
+        printResult(out, input, &result);
+    }
+    retval = finishOutput(out);
+    if (streamError(&reader)) {
+        fprintf(stderr, "Error reading stdin after line %lu\n", lineNum);
+        retval = EXIT_FAILURE;
+    }
+    streamClose(&reader);
+    eip712_worker_free(worker);
+    return retval;
+}
 
 int main(int argc, char *argv[]) {
 
     json_t const* json;
-    json_t const* jsonT;
-    json_t const* jsonV;
-    json_t const* jsonPT;
-
-    static char jsonStr[BUFSIZE] = {'\0'};
-    static char typesJsonStr[TYPES_BUFSIZE] = {'\0'};
-    static char primaryTypeJsonStr[PRIMETYPE_BUFSIZE] = {'\0'};
-    static char domainJsonStr[DOMAIN_BUFSIZE] = {'\0'};
-    static char messageJsonStr[MESSAGE_BUFSIZE] = {'\0'};
-    int chr, ctr;
-    FILE *f; 
+
+    inputFile input;
+    json_t *mem;
+    size_t poolSize;
+    static eip712Plan compiledPlan;
+    const eip712Plan *plan = NULL;
+    const char *cachePath = NULL, *fileName = NULL;
+    fileList files;
+    int jobs = -1;                  // -1 is the single file mode
+    unsigned arrayThreshold = BATCH_ARRAY_THRESHOLD;
+    int digest = 0, stream = 0, dir = 0;
+    outputState out;
+    planCache cache;
+    uint8_t typesId[32];
+    int ctr, errRet;
+
+    memset(&out, 0, sizeof(out));
+    memset(&files, 0, sizeof(files));
+    for (ctr=1; ctr<argc; ctr++) {
+        if (0 == strcmp(argv[ctr], "--plan-cache") && ctr+1 < argc) {
+            cachePath = argv[++ctr];
+        } else if (0 == strcmp(argv[ctr], "--jobs") && ctr+1 < argc) {
+            jobs = atoi(argv[++ctr]);
+        } else if (0 == strcmp(argv[ctr], "--array-threshold") && ctr+1 < argc) {
+            arrayThreshold = (unsigned)atoi(argv[++ctr]);
+        } else if (0 == strcmp(argv[ctr], "--digest")) {
+            digest = 1;
+        } else if (0 == strcmp(argv[ctr], "--stream")) {
+            stream = 1;
+        } else if (0 == strcmp(argv[ctr], "--verify")) {
+            out.verify = 1;
+        } else if (0 == strcmp(argv[ctr], "--format") && ctr+1 < argc) {
+            ctr++;
+            if (0 == strcmp(argv[ctr], "json")) {
+                out.format = FORMAT_JSON;
+            } else if (0 == strcmp(argv[ctr], "csv")) {
+                out.format = FORMAT_CSV;
+            } else if (0 != strcmp(argv[ctr], "text")) {
+                printf(USAGE);
+                freeFiles(&files);
+                return EXIT_FAILURE;
+            }
+        } else if (0 == strcmp(argv[ctr], "--dir") && ctr+1 < argc) {
+            if (!addDir(&files, argv[++ctr])) {
+                fprintf(stderr, "Cannot read directory %s\n", argv[ctr]);
+                freeFiles(&files);
+                return EXIT_FAILURE;
+            }
+            dir = 1;
+        } else if (!addFile(&files, NULL, argv[ctr])) {
+            freeFiles(&files);
+            return EXIT_FAILURE;
+        }
+    }
+    out.digest = digest;
+    // directories, verification and machine readable output are batch only
+    if (jobs < 0 && (dir || out.verify || FORMAT_TEXT != out.format)) {
+        jobs = 0;
+    }
+    // batch workers keep their plan in their context, the cache file is single file only
+    if (NULL != cachePath && (stream || jobs >= 0 || files.count > 1)) {
+        fprintf(stderr, "--plan-cache only works on a single file\n");
+        printf(USAGE);
+        freeFiles(&files);
+        return EXIT_FAILURE;
+    }
+    if (stream) {
+        freeFiles(&files);
+        return streamMain(&out);
+    }
+    if (jobs >= 0 && files.count > 0) {
+        errRet = batchMain(files.names, files.count, (unsigned)jobs, arrayThreshold, &out);
+        freeFiles(&files);
+        return errRet;
+    }
+    if (files.count > 0) {
+        fileName = files.names[0];
+    }
 
     // get file from cmd line or open default
-    if (NULL == (f = fopen(argv[1], "r"))) {
-        printf("USAGE: ./sim712.exe <filename>\n  Where <filename> is a properly formatted EIP-712 message.\n");
+    if (NULL == fileName || !loadFile(fileName, &input)) {
+        printf(USAGE);
+        freeFiles(&files);
         return 0;
     }
 
-    // read in the json file
-    ctr=0;
-    chr = fgetc(f);
-    while (chr != EOF && ctr < BUFSIZE-1) {
-        jsonStr[ctr++] = chr;
-        chr = fgetc(f);
-    }
-    
-    // parse out the 4 sections
-    parseJsonName("\"types\"", jsonStr, typesJsonStr, TYPES_BUFSIZE);
-    //printf("%s\n\n", typesJsonStr);
-    parseJsonName("\"domain\"", jsonStr, domainJsonStr, DOMAIN_BUFSIZE);
-    //printf("%s\n\n", domainJsonStr);
-    parseJsonName("\"message\"", jsonStr, messageJsonStr, MESSAGE_BUFSIZE);
-    //printf("%s\n\n", messageJsonStr);
-    parseJsonName("\"primaryType\"", jsonStr, primaryTypeJsonStr, MESSAGE_BUFSIZE);
-    //printf("%s\n\n", primaryTypeJsonStr);
-
-    json_t mem[JSON_OBJ_POOL_SIZE];
-    json = json_create(jsonStr, mem, sizeof mem / sizeof *mem );
+    // one parse of the whole document, the encoder looks up "types", "domain", "message"
+    // and "primaryType" in it
+    poolSize = jsonPoolSize(input.text);
+    if (NULL == (mem = malloc(poolSize * sizeof(json_t)))) {
+        printf("Out of memory for %s\n", fileName);
+        return EXIT_FAILURE;
+    }
+    json = json_create(input.text, mem, (unsigned)poolSize);
     if ( !json ) {
         printf("Error json create json, errno = %d.", errno);
         return EXIT_FAILURE;
@@ -180,22 +641,29 @@ int main(int argc, char *argv[]) {
 
     // encode domain separator
 
-    json_t memTypes[JSON_OBJ_POOL_SIZE];
-    json_t memVals[JSON_OBJ_POOL_SIZE];
-    json_t memPType[4];
-    jsonT = json_create(typesJsonStr, memTypes, sizeof memTypes / sizeof *memTypes );
-    jsonV = json_create(domainJsonStr, memVals, sizeof memVals / sizeof *memVals );
-    if ( !jsonT ) {
-        printf("Error json create jsonT, errno = %d.", errno);
-        return EXIT_FAILURE;
+    // compiled types come from the plan cache when these types were seen before
+    if (NULL != cachePath) {
+        if (SUCCESS != eip712_schema_id(json, typesId)) {
+            cachePath = NULL;
+        } else if (SUCCESS != planCacheOpen(&cache, cachePath)) {
+            printf("Could not read plan cache %s\n", cachePath);
+        } else {
+            plan = planCacheFind(&cache, typesId);
+        }
     }
-    if ( !jsonV ) {
-        printf("Error json create jsonV, errno = %d.", errno);
-        return EXIT_FAILURE;
+    if (NULL == plan) {
+        if (SUCCESS != (errRet = compile_plan(json, &compiledPlan))) {
+            printf("Error compiling types, error = %d.", errRet);
+            return EXIT_FAILURE;
+        }
+        plan = &compiledPlan;
+        if (NULL != cachePath && SUCCESS != planCacheAdd(&cache, typesId, plan)) {
+            printf("Could not add types to plan cache %s\n", cachePath);
+        }
     }
 
     uint8_t domainSeparator[32];
-    encode(jsonT, jsonV, "EIP712Domain", domainSeparator);
+    int dsStatus = encode_with_plan(plan, json, "EIP712Domain", domainSeparator);
     DEBUG_DISPLAY_VAL(BOLDGREEN "domainSeparator" RESET, "hash %s    ", 65, domainSeparator[ctr]);
 
     respair = json_getProperty(json, "results");
@@ -216,23 +684,16 @@ int main(int argc, char *argv[]) {
 
     // encode primaryType type
     printf("\n\n\n\n");
-    jsonV = json_create(messageJsonStr, memVals, sizeof memVals / sizeof *memVals );
-    jsonPT = json_create(primaryTypeJsonStr, memPType, sizeof memPType / sizeof *memPType );
-    if ( !jsonV ) {
-        printf("Error json create second jsonV, errno = %d.", errno);
-        return EXIT_FAILURE;
-    }
-    if ( !jsonPT) {
-        printf("Error json create jsonPT, errno = %d.", errno);
-        return EXIT_FAILURE;
-    }
-
     uint8_t msgHash[32];
-    const char *primeType = json_getValue(json_getProperty(jsonPT, "primaryType"));
+    int msgStatus = NULL_MSG_HASH;
+    const char *primeType = json_getPropertyValue(json, "primaryType");
 
-    if (0 == strncmp(primeType, "EIP712Domain", strlen(primeType))) {
+    if (NULL == primeType) {
+        printf("\"primaryType\" not found!\n");
+        return EXIT_FAILURE;
+    } else if (0 == strncmp(primeType, "EIP712Domain", strlen(primeType))) {
         printf("primary type is EIP712Domain, message hash is NULL\n");
-    } else if (2 == encode(jsonT, jsonV, primeType, msgHash)) {
+    } else if (NULL_MSG_HASH == (msgStatus = encode_with_plan(plan, json, primeType, msgHash))) {
         printf("message hash is NULL\n");
     } else {
         DEBUG_DISPLAY_VAL(BOLDGREEN "message" RESET, "hash %s    ", 65, msgHash[ctr]);
@@ -253,5 +714,22 @@ int main(int argc, char *argv[]) {
         printf("Should be %s\n", resval);
     }
 
+    if (digest) {
+        uint8_t digestHash[32];
+        if (SUCCESS != dsStatus || (SUCCESS != msgStatus && NULL_MSG_HASH != msgStatus)) {
+            printf("\ndigest not computed, error = %d\n", SUCCESS != dsStatus ? dsStatus : msgStatus);
+        } else {
+            eip712_digest(domainSeparator, SUCCESS == msgStatus ? msgHash : NULL, digestHash);
+            printf("\n");
+            DEBUG_DISPLAY_VAL(BOLDGREEN "digest" RESET, "hash %s    ", 65, digestHash[ctr]);
+        }
+    }
+
+    if (NULL != cachePath) {
+        planCacheClose(&cache);
+    }
+    free(mem);
+    unloadFile(&input);
+    freeFiles(&files);
     return EXIT_SUCCESS;
 }
@@ -27,8 +27,9 @@
         requires all complete json message strings to be enclosed by braces, i.e., { ... }
         Cannot have entire json string quoted, i.e., "{ ... }" will not work.
         Remove all quote escape chars, e.g., {"types":  not  {\"types\":
-    int values must be hex. Negative sign indicates negative value, e.g., -5, -8a67 
-        Note: Do not prefix ints or uints with 0x
+    ints: json numbers or strings, decimal or 0x prefixed hex, with an optional '-' sign.
+        Values are 256-bit and must fit the intN/uintN width. Decimals may have a fraction
+        and exponent if the value is whole, e.g., 1e+21.
     All hex and byte strings must be big-endian
     Byte strings and address should be prefixed by 0x
 */
@@ -38,14 +39,21 @@
 #include "keepkey/firmware/tiny-json.h"
 
 #define USE_KECCAK 1
+#include "trezor/crypto/sha3.h"
 #define ADDRESS_SIZE        42
 #define JSON_OBJ_POOL_SIZE  100
-#define STRBUFSIZE          511
 #define MAX_USERDEF_TYPES   10      // This is max number of user defined type allowed
 #define MAX_TYPESTRING      33      // maximum size for a type string
 #define MAX_ENCBYTEN_SIZE   66
-#define STACK_REENTRANCY_REQ    1280    // calculate this from a re-entrant call (unsigned)&p - (unsigned)&end)
-#define STACK_SIZE_GUARD        (STACK_REENTRANCY_REQ + 64) // Can't recurse without this much stack available
+#define ARRAY_HASH_WORDS    4       // arrays up to this many elements are hashed without a SHA3_CTX
+#define BYTES_CHUNK_BLOCKS  2       // keccak blocks of a bytes value decoded and hashed at a time
+#define DS_CACHE_SIZE       8       // domain separators kept per context
+#define SCHEMA_ID_DEPTH     8       // json nesting of a "types" object eip712_schema_id() walks
+#ifndef MAX_ENCODE_DEPTH
+#define MAX_ENCODE_DEPTH    16      // struct nesting levels of a value, frames in eip712_ctx
+#endif
+// EIP712_HOST is defined by hosted builds (simulator, batch tools). It adds the value index,
+// the domain separator cache and the parallelFor hook, which firmware has no RAM or threads for.
 
 typedef enum {
     NOT_ENCODABLE = 0,
@@ -56,9 +64,7 @@ typedef enum {
     BYTES,
     BYTES_N,
     BOOL,
-    UDEF_TYPE,
-    PREV_USERDEF,
-    TOO_MANY_UDEFS
+    UDEF_TYPE
 } basicType;
 
 typedef enum {
@@ -66,6 +72,146 @@ typedef enum {
     MESSAGE
 } dm;
 
+/*
+    Compiled types. compile_plan() resolves every type and field of a "types" object once:
+    field kinds, sizes and array dimensions, struct references and typehashes. The plan only
+    holds offsets and indices, no pointers, so it can be copied or stored as a whole.
+*/
+#define MAX_PLAN_TYPES      32      // types in one plan
+#define MAX_PLAN_FIELDS     256     // fields of all types in one plan
+#define PLAN_STRBUFSIZE     2048    // type and field names of one plan
+#define PLAN_NO_TYPE        0xFF    // planField.child of fields that are not structs
+#define PLAN_NO_STRING      0xFFFF
+
+typedef struct {
+    uint32_t nameHash;      // hash of the field name, looks up the value in a value index
+    uint16_t name;          // offset of the field name in plan strings
+    uint8_t kind;           // basicType, element type for arrays
+    uint8_t size;           // bytesN length, or intN/uintN width in bytes
+    uint8_t isSigned;       // 1 for intN
+    uint8_t arrayDims;      // 0 for a single value, 1 for "type[]", 2 for "type[][]", ...
+    uint8_t child;          // plan type index of a user defined type
+    uint8_t status;         // SUCCESS, or error found while resolving the field
+} planField;
+
+typedef struct {
+    uint16_t name;          // offset of the type name in plan strings
+    uint16_t firstField;    // index of the first field in plan fields
+    uint16_t numFields;     // a type may have all MAX_PLAN_FIELDS
+    uint8_t isDomain;       // 1 for EIP712Domain
+    uint8_t uniqueNames;    // 1 if no two fields have the same name
+    uint8_t status;         // SUCCESS, or error found while making the typehash
+    uint8_t typeHash[32];
+} planType;
+
+typedef struct {
+    uint16_t numTypes;
+    uint16_t numFields;
+    uint16_t strLen;
+    planType types[MAX_PLAN_TYPES];
+    planField fields[MAX_PLAN_FIELDS];
+    char strings[PLAN_STRBUFSIZE];
+} eip712Plan;
+
+// Array hash accumulator. Element words are collected in a small buffer so that typical
+// short arrays are hashed with a single fixed-length keccak; longer arrays spill into ctx.
+typedef struct {
+    uint8_t words[ARRAY_HASH_WORDS*32];
+    unsigned count;
+    struct SHA3_CTX ctx;
+} arrayHash;
+
+/*
+    Value index of a struct with many fields, built when its values are not in field order.
+    EIP712_HOST only, firmware walks the values.
+    Open addressing on the field name hash; slots hold json pool offsets from the first
+    value, so the index stays small enough to keep one per frame.
+*/
+#define VALUE_INDEX_SLOTS       128     // power of 2, at most 3/4 of the slots are used
+#define VALUE_INDEX_MIN_FIELDS  8       // fewer fields are found by walking the values
+#define VALUE_INDEX_EMPTY       0xFFFF
+
+#define VALUE_INDEX_NONE        0       // not built yet
+#define VALUE_INDEX_BUILT       1
+#define VALUE_INDEX_WALK        2       // not worth it or too many values, walk them
+
+// Encoder frame, one per struct being encoded and one per inner dimension of an array
+// being encoded. Replaces recursion of parseVals().
+typedef struct {
+    const planType *type;           // NULL for array frames
+    const json_t *vals;             // values of the struct
+    const json_t *nextVal;          // value after the last one found, likely the next field
+    uint8_t inOrder;                // 1 while every value was found at nextVal
+    uint8_t indexState;             // VALUE_INDEX_NONE, VALUE_INDEX_BUILT or VALUE_INDEX_WALK
+    uint8_t inArray;                // 1 while walking the elements of an array, always for array frames
+    uint8_t dims;                   // array frames: dimensions of the array, 0 for struct frames
+#ifdef EIP712_HOST
+    uint16_t valueIndex[VALUE_INDEX_SLOTS];
+#endif
+    const planField *elements;      // array frames: field of the array, kind of its elements
+    const json_t *element;          // array element being encoded
+    unsigned field;                 // index of the field being encoded in type
+    arrayHash arrHash;              // hash of the array being encoded
+    struct SHA3_CTX *hash;          // hashStruct being built, ctxBuf or the caller's
+    struct SHA3_CTX ctxBuf;
+} encodeFrame;
+
+// Type parser frame, one per user defined type being parsed. Replaces recursion of parseType().
+typedef struct {
+    const planType *type;
+    unsigned field;                 // index of the next field of type to parse
+} typeFrame;
+
+// Domain separator cache entry, least recently used is replaced
+typedef struct {
+    uint8_t key[32];                // keccak of the domain type fields and values, see dsCacheKey()
+    uint8_t domainSeparator[32];
+    uint32_t lastUse;               // dsCacheClock of the last hit or store, 0 if unused
+} dsCacheEntry;
+
+// Runs task(arg, worker, idx) for every idx in [0, count), in any order and possibly
+// concurrently. worker is below the ctx parallelWorkers and the same for tasks run one after
+// another, never for two at once.
+typedef void (*eip712Task)(void *arg, unsigned worker, size_t idx);
+typedef void (*eip712ParallelFor)(void *hookArg, size_t count, eip712Task task, void *arg);
+
+/*
+    Encoder context. All state changed while encoding lives here, so encodes on separate
+    contexts can run concurrently. Initialize with eip712_ctx_init(). encode() and the other
+    functions without a context use a static default context.
+
+    Size is MAX_ENCODE_DEPTH frames of 1000 bytes plus a 6.4 KB plan, about 23 KB at the
+    default depth of 16. EIP712_HOST adds 256 bytes per frame and 0.6 KB of domain separator
+    cache, about 88 KB at the makefile depth of 64.
+*/
+typedef struct {
+    dm confirmProp;
+    const char *nameForValue;                   // field name of the value being confirmed
+    uint8_t skipConfirm;                        // 1 to encode without review screens
+#ifdef EIP712_HOST
+    // Optional. With skipConfirm set, elements of struct arrays of at least
+    // parallelThreshold elements are encoded through parallelFor, then hashed in order.
+    eip712ParallelFor parallelFor;
+    void *parallelArg;
+    unsigned parallelThreshold;
+    unsigned parallelWorkers;                   // workers parallelFor may use, 0 counts as 1
+#endif
+    typeFrame typeFrames[MAX_USERDEF_TYPES+1];  // parseType() stack
+    const planType *typeOrder[MAX_USERDEF_TYPES+1]; // types in hashable type string order
+    encodeFrame frames[MAX_ENCODE_DEPTH];       // parseVals() stack
+    const char *dsname, *dsversion, *dschainId, *dsverifyingContract;
+    uint8_t planId[32];                         // eip712_schema_id() of the types plan was compiled from
+    uint8_t planReady;                          // 1 if plan holds the types of planId
+    eip712Plan plan;                            // plan used by eip712_encode()
+#ifdef EIP712_HOST
+    // Domain separators of eip712_encode(), with skipConfirm only since a hit skips the
+    // domain review. Not cleared by eip712_clear_cache(), entries are keyed on content.
+    dsCacheEntry dsCache[DS_CACHE_SIZE];
+    uint32_t dsCacheClock;
+    unsigned dsCacheHits, dsCacheMisses;
+#endif
+} eip712_ctx;
+
 // error list status
 #define SUCCESS              1
 #define NULL_MSG_HASH        2      // this is legal, not an error
@@ -76,7 +222,7 @@ typedef enum {
 #define ADDR_STRING_VFLOW    7
 #define BYTESN_STRING_ERROR  8
 #define BYTESN_SIZE_ERROR    9
-#define INT_ARRAY_ERROR     10
+#define INT_ARRAY_ERROR     10      // 10 to 12 are no longer returned, arrays of any type are encoded
 #define BYTESN_ARRAY_ERROR  11
 #define BOOL_ARRAY_ERROR    12
 #define RECURSION_ERROR     13
@@ -91,7 +237,7 @@ typedef enum {
 #define JSON_PTYPESOBJERR   21
 #define JSON_TYPE_S_ERR     22
 #define JSON_TYPE_S_NAMEERR 23
-#define UNUSED_ERR_2        24          // available for re-use
+#define JSON_CREATE_ERR     24          // json text could not be parsed
 #define JSON_NO_PAIRS       25
 #define JSON_PAIRS_NOTEXT   26
 #define JSON_NO_PAIRS_SIB   27
@@ -101,12 +247,32 @@ typedef enum {
 #define JSON_TYPE_T_NOVAL   31
 #define ADDR_STRING_NULL    32
 #define JSON_TYPE_WNOVAL    33
+#define PLAN_SIZE_ERROR     34
+#define INT_STRING_ERROR    35          // intN/uintN value is not an integer
+#define INT_RANGE_ERROR     36          // intN/uintN value does not fit the width
+#define HEX_STRING_ERROR    37          // address or bytes value is not 0x and whole hex bytes
+#define ARRAY_VALUE_ERROR   38          // array value, or an element of it, does not match the array type
+#define STRUCT_VALUE_ERROR  39          // value of a struct field is not a json object
+
+#define LAST_ERROR         STRUCT_VALUE_ERROR
+
 
-#define LAST_ERROR         JSON_TYPE_WNOVAL
+void eip712_ctx_init(eip712_ctx *ctx);
+// The plan of eip712_encode() is keyed on the content of the types object, so it is only
+// compiled again when the types change. This drops it, which is never needed for correct hashes.
+void eip712_clear_cache(eip712_ctx *ctx);
+int eip712_encode(eip712_ctx *ctx, const json_t *jsonTypes, const json_t *jsonVals, const char *typeS, uint8_t *hashRet);
+int eip712_compile_plan(eip712_ctx *ctx, const json_t *jsonTypes, eip712Plan *plan);
+int eip712_schema_id(const json_t *jsonTypes, uint8_t *id);
+int eip712_encode_with_plan(eip712_ctx *ctx, const eip712Plan *plan, const json_t *jsonVals, const char *typeS, uint8_t *hashRet);
 
+void eip712_digest(const uint8_t *domainSeparator, const uint8_t *msgHash, uint8_t *digest);
 
-int memcheck(void);
+// same as above on the default context
+void clearTypeHashCache(void);
 int encode(const json_t *jsonTypes, const json_t *jsonVals, const char *typeS, uint8_t *hashRet);
+int compile_plan(const json_t *jsonTypes, eip712Plan *plan);
+int encode_with_plan(const eip712Plan *plan, const json_t *jsonVals, const char *typeS, uint8_t *hashRet);
 
 #endif
 
@@ -77,6 +77,12 @@ void sha3_Final(SHA3_CTX *ctx, unsigned char* result);
 void keccak_Final(SHA3_CTX *ctx, unsigned char* result);
 void keccak_256(const unsigned char* data, size_t len, unsigned char* digest);
 void keccak_512(const unsigned char* data, size_t len, unsigned char* digest);
+void keccak256_32(const unsigned char* data, unsigned char* digest);
+void keccak256_64(const unsigned char* data, unsigned char* digest);
+void keccak256_block(const unsigned char* data, size_t len, unsigned char* digest);
+void keccak256_words(const unsigned char* data, size_t words, unsigned char* digest);
+void keccak_256_multi(const unsigned char* const data[], const size_t len[],
+		unsigned char* const digest[], size_t n);
 #endif
 
 void sha3_256(const unsigned char* data, size_t len, unsigned char* digest);
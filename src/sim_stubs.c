@@ -10,7 +10,6 @@
 
 static char strbuf[352];
 static bool button_request_acked = false;
-unsigned end;
 
 bool review(ButtonRequestType type, const char *request_title, const char *request_body,
             ...)
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./stream_reader.h"
+
+// Fills the chunks in turn. A chunk is handed over after every read that returns data, so
+// documents from a slow pipe are not held back until a whole chunk has arrived.
+static void *readChunks(void *arg) {
+    streamReader *reader = (streamReader *)arg;
+    int idx = 0;
+    ssize_t got;
+
+    for (;;) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->full[idx] && !reader->stop) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        if (reader->stop) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+        pthread_mutex_unlock(&reader->lock);
+
+        do {
+            got = read(reader->fd, reader->chunk[idx], STREAM_CHUNK_SIZE);
+        } while (0 > got && EINTR == errno);
+
+        pthread_mutex_lock(&reader->lock);
+        if (0 < got) {
+            reader->chunkLen[idx] = (size_t)got;
+            reader->full[idx] = 1;
+        } else if (0 == got) {
+            reader->eof = 1;
+        } else {
+            reader->error = 1;
+        }
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        if (0 >= got) {
+            break;
+        }
+        idx ^= 1;
+    }
+    return NULL;
+}
+
+int streamOpen(streamReader *reader, int fd) {
+    memset(reader, 0, sizeof(streamReader));
+    reader->fd = fd;
+    reader->cur = -1;
+    if (NULL == (reader->chunk[0] = malloc(STREAM_CHUNK_SIZE)) ||
+        NULL == (reader->chunk[1] = malloc(STREAM_CHUNK_SIZE))) {
+        free(reader->chunk[0]);
+        return 0;
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    if (0 != pthread_create(&reader->thread, NULL, readChunks, reader)) {
+        pthread_cond_destroy(&reader->changed);
+        pthread_mutex_destroy(&reader->lock);
+        free(reader->chunk[0]);
+        free(reader->chunk[1]);
+        return 0;
+    }
+    return 1;
+}
+
+// Appends len bytes to the line carried over a chunk boundary, returns 0 if out of memory
+static int carryLine(streamReader *reader, const char *text, size_t len) {
+    size_t size = reader->lineSize ? reader->lineSize : 256;
+    char *line;
+
+    while (reader->lineLen + len + 1 > size) {
+        size *= 2;
+    }
+    if (size != reader->lineSize) {
+        if (NULL == (line = realloc(reader->line, size))) {
+            return 0;
+        }
+        reader->line = line;
+        reader->lineSize = size;
+    }
+    memcpy(&reader->line[reader->lineLen], text, len);
+    reader->lineLen += len;
+    reader->line[reader->lineLen] = '\0';
+    return 1;
+}
+
+// Stops handing out lines after the caller ran out of memory
+static char *lineError(streamReader *reader) {
+    pthread_mutex_lock(&reader->lock);
+    reader->error = 1;
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+char *streamNextLine(streamReader *reader, size_t *len) {
+    char *start, *newline;
+    size_t avail;
+    int error;
+
+    for (;;) {
+        if (0 > reader->cur) {
+            pthread_mutex_lock(&reader->lock);
+            if (!reader->full[reader->take] && !reader->eof && !reader->error && NULL != reader->idle) {
+                pthread_mutex_unlock(&reader->lock);
+                reader->idle();
+                pthread_mutex_lock(&reader->lock);
+            }
+            while (!reader->full[reader->take] && !reader->eof && !reader->error) {
+                pthread_cond_wait(&reader->changed, &reader->lock);
+            }
+            if (!reader->full[reader->take]) {
+                error = reader->error;
+                pthread_mutex_unlock(&reader->lock);
+                // a last line without a newline
+                if (0 == reader->lineLen || error) {
+                    return NULL;
+                }
+                *len = reader->lineLen;
+                reader->lineLen = 0;
+                return reader->line;
+            }
+            pthread_mutex_unlock(&reader->lock);
+            reader->cur = reader->take;
+            reader->take ^= 1;
+            reader->pos = 0;
+        }
+
+        start = &reader->chunk[reader->cur][reader->pos];
+        avail = reader->chunkLen[reader->cur] - reader->pos;
+        if (NULL != (newline = memchr(start, '\n', avail))) {
+            *newline = '\0';
+            reader->pos += (size_t)(newline - start) + 1;
+            if (0 == reader->lineLen) {
+                *len = (size_t)(newline - start);
+                return start;
+            }
+            if (!carryLine(reader, start, (size_t)(newline - start))) {
+                return lineError(reader);
+            }
+            *len = reader->lineLen;
+            reader->lineLen = 0;
+            return reader->line;
+        }
+
+        // the rest of the chunk starts a line that ends in a later chunk
+        if (!carryLine(reader, start, avail)) {
+            return lineError(reader);
+        }
+        pthread_mutex_lock(&reader->lock);
+        reader->full[reader->cur] = 0;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        reader->cur = -1;
+    }
+}
+
+int streamError(streamReader *reader) {
+    int error;
+
+    pthread_mutex_lock(&reader->lock);
+    error = reader->error;
+    pthread_mutex_unlock(&reader->lock);
+    return error;
+}
+
+void streamClose(streamReader *reader) {
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->changed);
+    pthread_mutex_destroy(&reader->lock);
+    free(reader->chunk[0]);
+    free(reader->chunk[1]);
+    free(reader->line);
+}
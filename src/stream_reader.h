@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Double buffered line reader over a file descriptor, host only.
+
+    A reader thread fills one chunk while the caller takes lines out of the other, so
+    encoding the documents of one chunk overlaps reading the next. Lines are handed out in
+    place in the chunk; only a line that crosses a chunk boundary is copied.
+*/
+
+#ifndef __STREAM_READER_H__
+#define __STREAM_READER_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define STREAM_CHUNK_SIZE   (1 << 20)   // bytes per read buffer
+
+typedef struct {
+    int fd;
+    char *chunk[2];
+    size_t chunkLen[2];
+    int full[2];                    // filled by the reader thread and not yet released
+    int eof;                        // no chunks after the full ones
+    int error;                      // read failed
+    int stop;                       // set by streamClose()
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // caller side
+    int cur;                        // chunk lines are taken from, -1 for none
+    int take;                       // chunk to take next
+    size_t pos;                     // start of the next line in cur
+    char *line;                     // line that crossed a chunk boundary
+    size_t lineLen, lineSize;
+    void (*idle)(void);             // called, if set, before waiting for the reader thread
+} streamReader;
+
+// Starts reading fd. Returns 1, or 0 if out of memory or the thread cannot start.
+int streamOpen(streamReader *reader, int fd);
+// Returns the next line without its newline, nul terminated and writable until the next
+// call, with its length in len. Returns NULL at the end of input or on a read error.
+char *streamNextLine(streamReader *reader, size_t *len);
+// Returns 1 if reading failed
+int streamError(streamReader *reader);
+// Stops the reader thread, after any read it is blocked in, and frees the buffers. The
+// descriptor is left open.
+void streamClose(streamReader *reader);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "./thread_pool.h"
+#include "keepkey/firmware/eip712.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;            // remaining indices are [next, end)
+    size_t end;
+} poolRange;
+
+typedef struct {
+    poolRange *ranges;
+    unsigned jobs;
+    poolTask task;
+    void *arg;
+} poolRun;
+
+typedef struct {
+    poolRun *run;
+    unsigned id;
+    pthread_t thread;
+} poolWorker;
+
+typedef struct {
+    eip712Task task;
+    void *arg;
+} hookRun;
+
+static __thread unsigned inPoolThread;     // set while a thread works for poolFor()
+
+unsigned poolCpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned)cpus : 1;
+}
+
+static int takeOwn(poolRange *range, size_t *idx) {
+    int found = 0;
+
+    pthread_mutex_lock(&range->lock);
+    if (range->next < range->end) {
+        *idx = range->next++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return found;
+}
+
+// moves the upper half of the first non-empty victim range into the range of self
+static int steal(poolRun *run, unsigned self, size_t *idx) {
+    poolRange *victim, *own = &run->ranges[self];
+    size_t mid, end;
+    unsigned ctr;
+
+    for (ctr=1; ctr<run->jobs; ctr++) {
+        victim = &run->ranges[(self + ctr) % run->jobs];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            end = victim->end;
+            mid = victim->next + (victim->end - victim->next) / 2;
+            victim->end = mid;
+            pthread_mutex_unlock(&victim->lock);
+
+            // the victim keeps [next, mid), mid is worked on now, the rest can be stolen back
+            pthread_mutex_lock(&own->lock);
+            own->next = mid + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            *idx = mid;
+            return 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return 0;
+}
+
+static void *workerMain(void *arg) {
+    poolWorker *worker = (poolWorker *)arg;
+    poolRun *run = worker->run;
+    size_t idx;
+
+    inPoolThread = 1;
+    while (takeOwn(&run->ranges[worker->id], &idx) || steal(run, worker->id, &idx)) {
+        run->task(run->arg, worker->id, idx);
+    }
+    inPoolThread = 0;
+    return NULL;
+}
+
+int poolFor(size_t count, unsigned jobs, poolTask task, void *arg) {
+    poolWorker *workers;
+    poolRun run;
+    unsigned ctr;
+    size_t idx;
+
+    if (jobs == 0) {
+        jobs = 1;
+    }
+    if (jobs > count) {
+        jobs = count ? (unsigned)count : 1;
+    }
+    if (jobs == 1) {
+        for (idx=0; idx<count; idx++) {
+            task(arg, 0, idx);
+        }
+        return SUCCESS;
+    }
+
+    run.ranges = calloc(jobs, sizeof(poolRange));
+    workers = calloc(jobs, sizeof(poolWorker));
+    if (NULL == run.ranges || NULL == workers) {
+        free(run.ranges);
+        free(workers);
+        return GENERAL_ERROR;
+    }
+    run.jobs = jobs;
+    run.task = task;
+    run.arg = arg;
+    for (ctr=0; ctr<jobs; ctr++) {
+        pthread_mutex_init(&run.ranges[ctr].lock, NULL);
+        run.ranges[ctr].next = count * ctr / jobs;
+        run.ranges[ctr].end = count * (ctr + 1) / jobs;
+        workers[ctr].run = &run;
+        workers[ctr].id = ctr;
+    }
+
+    for (ctr=1; ctr<jobs; ctr++) {
+        if (0 != pthread_create(&workers[ctr].thread, NULL, workerMain, &workers[ctr])) {
+            workers[ctr].run = NULL;
+        }
+    }
+    workerMain(&workers[0]);
+    for (ctr=1; ctr<jobs; ctr++) {
+        if (NULL != workers[ctr].run) {
+            pthread_join(workers[ctr].thread, NULL);
+        }
+    }
+
+    for (ctr=0; ctr<jobs; ctr++) {
+        pthread_mutex_destroy(&run.ranges[ctr].lock);
+    }
+    free(run.ranges);
+    free(workers);
+    return SUCCESS;
+}
+
+static void hookTask(void *arg, unsigned worker, size_t idx) {
+    hookRun *run = (hookRun *)arg;
+
+    run->task(run->arg, worker, idx);
+}
+
+void poolParallelFor(void *hookArg, size_t count, eip712Task task, void *arg) {
+    hookRun run;
+    size_t idx;
+
+    run.task = task;
+    run.arg = arg;
+    if (inPoolThread || SUCCESS != poolFor(count, *(unsigned *)hookArg, hookTask, &run)) {
+        for (idx=0; idx<count; idx++) {
+            task(arg, 0, idx);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022 markrypto  (cryptoakorn@gmail.com)
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Work-stealing parallel for loop over pthreads, host only.
+
+    The index range is split evenly between the workers. A worker takes indices from the
+    front of its own range; when that runs dry it steals the upper half of what is left in
+    another worker's range. Uneven item costs are balanced without a shared queue.
+*/
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <stddef.h>
+#include "keepkey/firmware/eip712.h"
+
+// Called once per index. worker is 0..jobs-1 and stays the same within one thread, so
+// tasks can keep per-worker state indexed by it.
+typedef void (*poolTask)(void *arg, unsigned worker, size_t idx);
+
+unsigned poolCpus(void);
+// Runs task for every index in [0, count) on up to jobs threads, the caller being one of
+// them. Threads that cannot be started just leave their share to be stolen.
+// Returns SUCCESS, or GENERAL_ERROR if out of memory.
+int poolFor(size_t count, unsigned jobs, poolTask task, void *arg);
+// eip712_ctx parallelFor hook, hookArg points to the unsigned number of jobs, which is also
+// the ctx parallelWorkers. Runs serially as worker 0 when called from a pool thread, so nested
+// arrays do not multiply the threads.
+void poolParallelFor(void *hookArg, size_t count, eip712Task task, void *arg);
+
+#endif